@@ -0,0 +1,596 @@
+#!/bin/sh
+
+# Regression run for "make check". Each case drives simplefs with a script of shell
+# commands on a fresh image and compares what it copied out. The shell checks the
+# mounted filesystem at the end, catching blocks leaked in its reference counts, and
+# fsck goes over the image afterwards for doubly used blocks and bad inodes.
+
+dir=$(mktemp -d /tmp/fscheck.XXXXXX)
+trap 'rm -rf $dir' EXIT
+img=$dir/image
+failed=0
+
+head -c 300000 /dev/urandom > $dir/small
+head -c 2000000 /dev/urandom > $dir/big
+head -c 1000000 /dev/zero > $dir/zeros
+yes "a line of text that compresses well" | head -c 1000000 > $dir/text
+
+fail() {
+	echo "FAIL $name: $1"
+	cat $dir/log
+	failed=$((failed+1))
+}
+
+# run <name> <nblocks>, with the shell commands on stdin
+run() {
+	name=$1
+	nblocks=$2
+	before=$failed
+	rm -f $img
+	{ cat; echo check; } | ./simplefs $img $nblocks > $dir/log 2>&1
+	if grep -q "check found\|check failed" $dir/log; then
+		fail "the mounted check found problems"
+	fi
+	checkimage
+}
+
+# again, with more shell commands on stdin for the image the case left behind
+again() {
+	{ cat; echo check; } | ./simplefs $img $nblocks >> $dir/log 2>&1
+	if grep -q "check found\|check failed" $dir/log; then
+		fail "the mounted check found problems"
+	fi
+	checkimage
+}
+
+checkimage() {
+	if ! ./fsck $img $nblocks >> $dir/log 2>&1; then
+		fail "fsck found problems"
+	fi
+}
+
+# prints the result of the case once its outputs are compared
+finish() {
+	if [ $failed -eq $before ]; then
+		echo "ok   $name"
+	fi
+}
+
+# expect <pattern>, which the output of the case must contain
+expect() {
+	if ! grep -q "$1" $dir/log; then
+		fail "no \"$1\" in the output"
+	fi
+}
+
+# same <copied out> <original>
+same() {
+	if ! cmp -s $dir/$1 $dir/$2; then
+		fail "$1 differs from $2"
+	fi
+}
+
+run plain 2000 <<EOF
+format
+mount
+create
+copyin $dir/big 1
+copyout 1 $dir/out1
+truncate 1 100000
+create
+copyin $dir/small 2
+delete 1
+copyout 2 $dir/out2
+EOF
+same out1 big
+same out2 small
+# plugged writes reach the image merged into a few large transfers
+if ! awk '/plugged block writes sent in/ { merged = $1 >= 10*$7 } END { exit !merged }' $dir/log; then
+	fail "plugged writes were not merged"
+fi
+finish
+
+# 2000 disk blocks make 500 filesystem blocks of 16 KB
+run blocksize 2000 <<EOF
+format blocksize=16384
+mount
+create
+copyin $dir/big 1
+copyout 1 $dir/out1
+truncate 1 5000
+debug summary
+EOF
+same out1 big
+expect "500 blocks of 16384 bytes"
+expect "1 data blocks"
+finish
+
+# an inode count or a ratio of disk bytes per inode sizes the inode table
+run inodes 2000 <<EOF
+format inodes=1000
+mount
+create
+copyin $dir/small 1
+copyout 1 $dir/out1
+debug summary
+EOF
+same out1 small
+expect "8 inode blocks"
+./simplefs $img 2000 >> $dir/log 2>&1 <<EOF
+format ratio=65536
+mount
+debug summary
+EOF
+checkimage
+expect "128 inodes"
+finish
+
+# random data is stored raw, text in compressed clusters of under a hundred blocks
+run compress 2000 <<EOF
+format compress
+mount
+create
+copyin $dir/big 1
+create
+copyin $dir/zeros 2
+create
+copyin $dir/text 3
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+copyout 3 $dir/out3
+debug summary 3
+truncate 1 123456
+EOF
+same out1 big
+same out2 zeros
+same out3 text
+expect "1000000 bytes stored in [0-9][0-9] data blocks"
+finish
+
+# the largest blocks and clusters, so every pooled buffer is used at its full size
+run bigblocks 4000 <<EOF
+format compress blocksize=65536
+mount
+create
+copyin $dir/big 1
+create
+copyin $dir/text 2
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+truncate 2 70000
+defrag
+EOF
+same out1 big
+same out2 text
+finish
+
+# the second copy shares every one of the first's 489 blocks
+run dedup 2000 <<EOF
+format dedup
+mount
+create
+copyin $dir/big 1
+create
+copyin $dir/big 2
+debug summary
+delete 1
+copyout 2 $dir/out2
+EOF
+same out2 big
+expect "489 blocks saved"
+finish
+
+# whole blocks of zeros and a file grown by truncate take no data blocks
+head -c 500000 /dev/zero > $dir/zeros2
+run holes 2000 <<EOF
+format
+mount
+create
+copyin $dir/zeros 1
+create
+truncate 2 500000
+debug summary
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+EOF
+same out1 zeros
+same out2 zeros2
+expect "1 data blocks, 1 indirect blocks, 367 holes"
+finish
+
+# a snapshot copies an inode block only when the live one first changes
+run snapshot 2000 <<EOF
+format
+mount
+create
+copyin $dir/small 1
+snapshot s1
+snapshots
+copyin $dir/big 1
+snapshots
+create
+copyin $dir/small 2
+mount s1
+copyout 1 $dir/out1
+mount
+copyout 1 $dir/out2
+rmsnapshot s1
+delete 2
+EOF
+same out1 small
+same out2 big
+expect "s1.*0 of 200 inode blocks copied"
+expect "s1.*1 of 200 inode blocks copied"
+finish
+
+# an inode table too big for a one block snapshot map
+run bigsnapshot 20000 <<EOF
+format
+mount
+create
+copyin $dir/small 1
+snapshot s1
+copyin $dir/big 1
+mount s1
+copyout 1 $dir/out1
+mount
+snapshot s2
+rmsnapshot s1
+delete 1
+EOF
+same out1 small
+finish
+
+# a disk striped across three image files
+img=$dir/a,$dir/b,$dir/c
+run striped 3000 <<EOF
+format
+mount
+create
+copyin $dir/big 1
+create
+copyin $dir/small 2
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+EOF
+same out1 big
+same out2 small
+# a third of 3000 blocks, rounded up to whole 16 block stripe units
+for member in a b c; do
+	if [ $(wc -c < $dir/$member) -ne 4128768 ]; then
+		fail "member $member is not a third of the disk"
+	fi
+done
+img=$dir/image
+finish
+
+# lazy and background mounts build the reference counts before the first change
+run lazy 2000 <<EOF
+format
+mount
+create
+copyin $dir/small 1
+quit
+EOF
+again <<EOF
+mount -l
+copyout 1 $dir/out1
+create
+copyin $dir/big 2
+EOF
+again <<EOF
+mount -b
+copyout 2 $dir/out2
+delete 1
+create
+copyin $dir/small 1
+EOF
+same out1 small
+same out2 big
+finish
+
+# fs_debug as JSON, and limited to one inode
+run debug 2000 <<EOF
+format
+mount
+create
+copyin $dir/small 1
+create
+copyin $dir/big 2
+debug json
+debug 2
+EOF
+expect '{"inode": 1, "size": 300000,'
+expect '"summary": {"files": 2, "bytes": 2300000,'
+expect "^inode: 2$"
+if grep -q "^inode: 1$" $dir/log; then
+	fail "debug 2 listed inode 1"
+fi
+finish
+
+# fsck finds and repairs inode 2 pointing out of the disk and at a block of inode 1
+run fsck 2000 <<EOF
+format
+mount
+create
+copyin $dir/small 1
+create
+copyin $dir/small 2
+EOF
+# inode 2 is 64 bytes into the first inode block, its direct pointers 8 bytes into it
+printf '\077\102\017\000\311\000\000\000' | dd of=$img bs=1 seek=4168 conv=notrunc 2>/dev/null
+if ./fsck -j 4 $img $nblocks >> $dir/log 2>&1; then
+	fail "fsck missed the damage"
+fi
+./fsck -r -j 4 $img $nblocks >> $dir/log 2>&1 || fail "fsck could not repair the damage"
+checkimage
+expect "1 pointers out of range"
+expect "1 blocks with two owners"
+expect "2 problems repaired, 0 left"
+again <<EOF
+mount
+copyout 1 $dir/out1
+EOF
+same out1 small
+finish
+
+# the block map cache serves repeated reads, and forgets blocks freed under it
+run mapcache 2000 <<EOF
+format
+mount
+create
+copyin $dir/big 1
+copyout 1 $dir/out1
+copyout 1 $dir/out1
+truncate 1 0
+create
+copyin $dir/small 2
+copyin $dir/big 1
+delete 2
+copyout 1 $dir/out2
+EOF
+same out1 big
+same out2 big
+expect "block map cache: [0-9]* lookups, 9[0-9]\.[0-9]% hits"
+finish
+
+# zeros written over preallocated blocks keep them allocated
+run fallocate 2000 <<EOF
+format
+mount
+create
+fallocate 1 0 1000000
+copyin $dir/zeros 1
+debug summary
+copyout 1 $dir/out1
+copyin $dir/small 1
+truncate 1 0
+EOF
+same out1 zeros
+expect "245 data blocks, 1 indirect blocks, 0 holes"
+finish
+
+# a file grown after an earlier one was deleted moves into the freed space with first fit,
+# and stays after its old blocks with the other policies; its indirect block splits it once
+grow() {
+	cat <<EOF
+format
+mount
+alloc $1
+create
+create
+create
+copyin $dir/small 1
+copyin $dir/small 2
+copyin $dir/small 3
+delete 1
+copyin $dir/big 3
+debug summary 3
+copyout 3 $dir/out3
+EOF
+}
+grow firstfit > $dir/commands
+run alloc 4000 < $dir/commands
+same out3 big
+for policy in goal reserve; do
+	grow $policy > $dir/commands
+	again < $dir/commands
+	same out3 big
+done
+if [ $(grep -c "4 extents, 1 fragmented files" $dir/log) -ne 1 ] || [ $(grep -c "2 extents, 1 fragmented files" $dir/log) -ne 2 ]; then
+	fail "the policies placed the grown file wrong"
+fi
+finish
+
+# the device models charge their time, and only a hard disk seeks
+run model 2000 <<EOF
+model hdd
+format
+mount
+create
+copyin $dir/big 1
+copyout 1 $dir/out1
+EOF
+expect "modeled hdd time, [1-9][0-9]* seeks"
+again <<EOF
+model ssd,bw=100
+mount
+copyout 1 $dir/out2
+EOF
+same out1 big
+same out2 big
+expect "modeled ssd time, 0 seeks"
+finish
+
+# with requests queued on a hard disk, C-LOOK spends less time seeking than FIFO
+name=scheduler
+before=$failed
+rm -f $img
+./diskbench -n 4000 -m hdd -q 8 -t 1 $img > $dir/log 2>&1 || fail "diskbench failed"
+expect "deadline: [0-9]* reads"
+if ! awk '/modeled hdd time/ { time[n++] = $1 } END { exit !(n == 3 && time[1] < time[0]) }' $dir/log; then
+	fail "C-LOOK was no faster than FIFO"
+fi
+finish
+
+# a budgeted pass moves the first file, the next one carries on with the second
+run defrag 4000 <<EOF
+format
+mount
+alloc firstfit
+create
+create
+copyin $dir/small 1
+copyin $dir/small 2
+copyin $dir/big 1
+defrag budget=100
+defrag
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+EOF
+same out1 big
+same out2 small
+expect "after: 2 files, 1 fragmented"
+expect "after: 2 files, 0 fragmented"
+finish
+
+# with discard, deleting a file punches its 2 MB out of the image
+run discard 2000 <<EOF
+format discard
+mount
+create
+copyin $dir/big 1
+quit
+EOF
+full=$(du -k $img | cut -f1)
+again <<EOF
+mount
+delete 1
+EOF
+empty=$(du -k $img | cut -f1)
+if [ $((full - empty)) -lt 1900 ]; then
+	fail "the image only shrank from $full KB to $empty KB"
+fi
+finish
+
+# a read-only mount refuses changes and serves readers on several threads
+run readonly 2000 <<EOF
+format
+mount
+create
+copyin $dir/big 1
+quit
+EOF
+./simplefs $img 2000 >> $dir/log 2>&1 <<EOF
+mount -r
+copyout 1 $dir/out1
+create
+EOF
+./readbench -j 4 -t 1 $img 2000 1 >> $dir/log 2>&1 || fail "readbench failed"
+checkimage
+same out1 big
+expect "filesystem is mounted read-only"
+expect "4 threads: "
+finish
+
+# a full mount reads back the indirect blocks hot at the last unmount, a lazy one does not
+run warm 2000 <<EOF
+format
+mount
+create
+copyin $dir/big 1
+copyout 1 $dir/out1
+quit
+EOF
+again <<EOF
+mount
+copyout 1 $dir/out2
+EOF
+again <<EOF
+mount -l
+copyout 1 $dir/out3
+EOF
+same out2 big
+same out3 big
+if [ $(grep -c "warm-up: 1 blocks in 1 reads" $dir/log) -ne 1 ]; then
+	fail "the warm-up did not run on the full mount alone"
+fi
+finish
+
+# files grown in turn from a partial last block, one into preallocated blocks; once debug
+# lets the blocks held ahead of their tails go, only the 1467 data, 3 indirect and 400
+# inode blocks are in use
+run append 4000 <<EOF
+format
+mount
+create
+create
+create
+copyin $dir/small 1
+copyin $dir/small 2
+copyin $dir/big 1
+copyin $dir/big 2
+fallocate 3 0 1000000
+copyin $dir/big 3
+debug summary
+copyout 1 $dir/out1
+copyout 2 $dir/out2
+copyout 3 $dir/out3
+EOF
+same out1 big
+same out2 big
+same out3 big
+expect "1870 blocks used"
+finish
+
+# a file that starts with the directory magic is still a file
+printf '1rid' > $dir/magic
+cat $dir/small >> $dir/magic
+run directories 2000 <<EOF
+format
+mount
+mkroot
+mkdir /a
+touch /a/b
+rm /a/b
+touch /f
+copyin $dir/magic 3
+ls /
+lookup /f/x
+mkdir /f/y
+copyout 3 $dir/out1
+EOF
+expect "2 a/"
+expect "3 f$"
+expect "/f/x not found"
+expect "inode 3 is not a directory"
+same out1 magic
+finish
+
+# fsserver with fsload as its clients, over the socket and over shared memory rings
+run server 4000 <<EOF
+format
+EOF
+./fsserver $img 4000 $dir/socket >> $dir/log 2>&1 &
+server=$!
+sleep 1
+./fsload -c 2 -t 1 -w 50 $dir/socket >> $dir/log 2>&1 || fail "fsload failed"
+./fsload -m shm -c 2 -t 1 -w 50 $dir/socket >> $dir/log 2>&1 || fail "fsload failed over shared memory"
+kill $server
+wait $server
+# each client deletes its file when it is done
+./simplefs $img 4000 >> $dir/log 2>&1 <<EOF
+mount
+debug summary
+EOF
+checkimage
+expect "socket: 2 clients"
+expect "shm: 2 clients"
+expect "0 files holding 0 bytes"
+finish
+
+if [ $failed -gt 0 ]; then
+	echo "$failed checks failed"
+	exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,408 @@
+
+#include "dir.h"
+#include "fs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+	A directory is an ordinary file laid out as an extendible hash table.
+	The header holds a table from the low globaldepth bits of a name's hash
+	to a bucket, and each bucket is one DIR_BUCKET_SIZE chunk of the file
+	packed with entries of (inumber, name length, name). When a bucket fills
+	it is split in two, doubling the table first if it is already as deep
+	as the bucket, so a lookup always costs one header and one bucket read.
+*/
+
+#define DIR_MAGIC       0x64697231 // "dir1"
+#define DIR_MAX_DEPTH   10         // table of 1024 buckets, close to the largest file
+#define DIR_HEADER_SIZE (2*DIR_BUCKET_SIZE)
+#define DIR_ENTRY_HEAD  5          // inumber and name length in front of each name
+
+struct dir_header {
+	int magic;
+	int globaldepth;
+	int nbuckets;
+	int table[1<<DIR_MAX_DEPTH];
+};
+
+struct dir_bucket {
+	short depth;
+	short count;
+	short used;
+	short unused;
+	char entries[DIR_BUCKET_SIZE - 4*sizeof(short)];
+};
+
+static unsigned dir_hash( const char *name, int length )
+{
+	unsigned hash = 2166136261u;
+	int i;
+	for(i=0;i<length;i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static int dir_checkname( const char *name )
+{
+	int length = strlen(name);
+	if(length==0 || length>DIR_NAME_MAX || strchr(name,'/')) {
+		printf("ERROR: invalid name \"%s\"\n",name);
+		return 0;
+	}
+	return length;
+}
+
+static int dir_readheader( int dinumber, struct dir_header *header )
+{
+	if(!fs_isdir(dinumber)) return 0;
+	if(fs_read(dinumber,(char*)header,sizeof(*header),0)!=sizeof(*header)) return 0;
+	return header->magic==DIR_MAGIC;
+}
+
+static int dir_writeheader( int dinumber, struct dir_header *header )
+{
+	return fs_write(dinumber,(const char*)header,sizeof(*header),0)==sizeof(*header);
+}
+
+static int dir_readbucket( int dinumber, int bucket, struct dir_bucket *b )
+{
+	return fs_read(dinumber,(char*)b,sizeof(*b),DIR_HEADER_SIZE+bucket*DIR_BUCKET_SIZE)==sizeof(*b);
+}
+
+static int dir_writebucket( int dinumber, int bucket, struct dir_bucket *b )
+{
+	return fs_write(dinumber,(const char*)b,sizeof(*b),DIR_HEADER_SIZE+bucket*DIR_BUCKET_SIZE)==sizeof(*b);
+}
+
+// returns the offset of the entry for name within the bucket, or -1
+static int dir_find( struct dir_bucket *b, const char *name, int length )
+{
+	int offset = 0;
+	while(offset<b->used) {
+		int entrylength = (unsigned char)b->entries[offset+4];
+		if(entrylength==length && !memcmp(b->entries+offset+DIR_ENTRY_HEAD,name,length)) {
+			return offset;
+		}
+		offset += DIR_ENTRY_HEAD + entrylength;
+	}
+	return -1;
+}
+
+static void dir_append( struct dir_bucket *b, const char *name, int length, int inumber )
+{
+	char *entry = b->entries + b->used;
+	memcpy(entry,&inumber,4);
+	entry[4] = length;
+	memcpy(entry+DIR_ENTRY_HEAD,name,length);
+	b->used += DIR_ENTRY_HEAD + length;
+	b->count++;
+}
+
+// turns an empty file into an empty directory with a single bucket
+static int dir_format( int dinumber )
+{
+	struct dir_header header;
+	struct dir_bucket b;
+
+	memset(&header,0,sizeof(header));
+	header.magic = DIR_MAGIC;
+	header.globaldepth = 0;
+	header.nbuckets = 1;
+	header.table[0] = 0;
+
+	memset(&b,0,sizeof(b));
+
+	return dir_writeheader(dinumber,&header) && dir_writebucket(dinumber,0,&b);
+}
+
+/*
+	Moves the entries of bucket index whose next hash bit is set into a new bucket,
+	doubling the table first if needed. Returns one on success, zero if the
+	directory cannot grow any more.
+*/
+static int dir_split( int dinumber, struct dir_header *header, int index, struct dir_bucket *old )
+{
+	struct dir_bucket fresh, kept;
+	int bucket = header->table[index];
+	int bit = old->depth;
+	int offset, i;
+
+	if(old->depth==header->globaldepth) {
+		if(header->globaldepth==DIR_MAX_DEPTH) {
+			printf("ERROR: directory %d is full\n",dinumber);
+			return 0;
+		}
+		for(i=0;i<(1<<header->globaldepth);i++) {
+			header->table[i+(1<<header->globaldepth)] = header->table[i];
+		}
+		header->globaldepth++;
+	}
+
+	memset(&fresh,0,sizeof(fresh));
+	memset(&kept,0,sizeof(kept));
+	fresh.depth = kept.depth = old->depth+1;
+
+	for(offset=0;offset<old->used;) {
+		int inumber;
+		int length = (unsigned char)old->entries[offset+4];
+		const char *name = old->entries+offset+DIR_ENTRY_HEAD;
+		memcpy(&inumber,old->entries+offset,4);
+		if((dir_hash(name,length)>>bit)&1) {
+			dir_append(&fresh,name,length,inumber);
+		} else {
+			dir_append(&kept,name,length,inumber);
+		}
+		offset += DIR_ENTRY_HEAD + length;
+	}
+
+	if(!dir_writebucket(dinumber,header->nbuckets,&fresh)) {
+		printf("ERROR: directory %d is full\n",dinumber);
+		return 0;
+	}
+	for(i=0;i<(1<<header->globaldepth);i++) {
+		if(header->table[i]==bucket && ((i>>bit)&1)) {
+			header->table[i] = header->nbuckets;
+		}
+	}
+	header->nbuckets++;
+
+	*old = kept;
+	return dir_writebucket(dinumber,bucket,&kept) && dir_writeheader(dinumber,header);
+}
+
+static int dir_insert( int dinumber, const char *name, int inumber )
+{
+	struct dir_header header;
+	struct dir_bucket b;
+	int length = strlen(name);
+	unsigned hash = dir_hash(name,length);
+
+	if(!dir_readheader(dinumber,&header)) {
+		printf("ERROR: inode %d is not a directory\n",dinumber);
+		return 0;
+	}
+
+	while(1) {
+		int index = hash & ((1<<header.globaldepth)-1);
+		if(!dir_readbucket(dinumber,header.table[index],&b)) return 0;
+
+		if(dir_find(&b,name,length)>=0) {
+			printf("ERROR: %s already exists\n",name);
+			return 0;
+		}
+
+		if(b.used+DIR_ENTRY_HEAD+length<=sizeof(b.entries)) {
+			dir_append(&b,name,length,inumber);
+			return dir_writebucket(dinumber,header.table[index],&b);
+		}
+
+		if(!dir_split(dinumber,&header,index,&b)) return 0;
+	}
+}
+
+// the inode says whether it is a directory, the magic only guards against a damaged one
+int dir_isdir( int dinumber )
+{
+	int magic;
+	if(!fs_isdir(dinumber)) return 0;
+	return fs_read(dinumber,(char*)&magic,sizeof(magic),0)==sizeof(magic) && magic==DIR_MAGIC;
+}
+
+int dir_mkroot()
+{
+	int inumber = fs_create_with(FS_CREATE_DIR);
+
+	if(inumber!=DIR_ROOT) {
+		if(inumber>0) fs_delete(inumber);
+		printf("ERROR: inode %d is already in use\n",DIR_ROOT);
+		return 0;
+	}
+
+	return dir_format(inumber);
+}
+
+int dir_lookup( int dinumber, const char *name )
+{
+	struct dir_header header;
+	struct dir_bucket b;
+	int length = strlen(name);
+	int offset, inumber;
+
+	if(!dir_readheader(dinumber,&header)) return 0;
+	if(!dir_readbucket(dinumber,header.table[dir_hash(name,length)&((1<<header.globaldepth)-1)],&b)) return 0;
+
+	offset = dir_find(&b,name,length);
+	if(offset<0) return 0;
+
+	memcpy(&inumber,b.entries+offset,4);
+	return inumber;
+}
+
+static int dir_createwith( int dinumber, const char *name, int flags )
+{
+	int inumber;
+
+	if(!dir_checkname(name)) return 0;
+	if(dir_lookup(dinumber,name)) {
+		printf("ERROR: %s already exists\n",name);
+		return 0;
+	}
+
+	inumber = fs_create_with(flags);
+	if(inumber<=0) return 0;
+
+	if(!dir_insert(dinumber,name,inumber)) {
+		fs_delete(inumber);
+		return 0;
+	}
+	return inumber;
+}
+
+int dir_create( int dinumber, const char *name )
+{
+	return dir_createwith(dinumber,name,0);
+}
+
+int dir_mkdir( int dinumber, const char *name )
+{
+	int inumber = dir_createwith(dinumber,name,FS_CREATE_DIR);
+	if(!inumber) return 0;
+
+	if(!dir_format(inumber)) {
+		dir_unlink(dinumber,name);
+		return 0;
+	}
+	return inumber;
+}
+
+static int dir_isempty( int dinumber )
+{
+	struct dir_header header;
+	struct dir_bucket b;
+	int i;
+
+	if(!dir_readheader(dinumber,&header)) return 0;
+	for(i=0;i<header.nbuckets;i++) {
+		if(!dir_readbucket(dinumber,i,&b) || b.count>0) return 0;
+	}
+	return 1;
+}
+
+int dir_unlink( int dinumber, const char *name )
+{
+	struct dir_header header;
+	struct dir_bucket b;
+	int length = strlen(name);
+	int bucket, offset, inumber, entrylength;
+
+	if(!dir_readheader(dinumber,&header)) return 0;
+	bucket = header.table[dir_hash(name,length)&((1<<header.globaldepth)-1)];
+	if(!dir_readbucket(dinumber,bucket,&b)) return 0;
+
+	offset = dir_find(&b,name,length);
+	if(offset<0) {
+		printf("ERROR: %s does not exist\n",name);
+		return 0;
+	}
+	memcpy(&inumber,b.entries+offset,4);
+
+	if(dir_isdir(inumber) && !dir_isempty(inumber)) {
+		printf("ERROR: directory %s is not empty\n",name);
+		return 0;
+	}
+
+	entrylength = DIR_ENTRY_HEAD + length;
+	memmove(b.entries+offset,b.entries+offset+entrylength,b.used-offset-entrylength);
+	b.used -= entrylength;
+	b.count--;
+	memset(b.entries+b.used,0,entrylength);
+
+	if(!dir_writebucket(dinumber,bucket,&b)) return 0;
+	return fs_delete(inumber);
+}
+
+int dir_opendir( int dinumber, struct dir_cursor *cursor )
+{
+	cursor->dinumber = dinumber;
+	cursor->bucket = 0;
+	cursor->offset = 0;
+	cursor->loaded = 0;
+	return dir_isdir(dinumber);
+}
+
+int dir_readdir( struct dir_cursor *cursor, char *name, int *inumber )
+{
+	struct dir_bucket *b = (struct dir_bucket *)cursor->block;
+
+	while(1) {
+		if(!cursor->loaded) {
+			// buckets are appended one after another, so the end of the file ends the walk
+			if(!dir_readbucket(cursor->dinumber,cursor->bucket,b)) return 0;
+			cursor->loaded = 1;
+			cursor->offset = 0;
+		}
+		if(cursor->offset<b->used) {
+			int length = (unsigned char)b->entries[cursor->offset+4];
+			memcpy(inumber,b->entries+cursor->offset,4);
+			memcpy(name,b->entries+cursor->offset+DIR_ENTRY_HEAD,length);
+			name[length] = 0;
+			cursor->offset += DIR_ENTRY_HEAD + length;
+			return 1;
+		}
+		cursor->bucket++;
+		cursor->loaded = 0;
+	}
+}
+
+/*
+	Walks a slash separated path from the root directory.
+	Returns the inode it names, or zero if some part of it does not exist.
+*/
+int dir_resolve( const char *path )
+{
+	char name[DIR_NAME_MAX+1];
+	int inumber = DIR_ROOT;
+
+	while(*path) {
+		int length;
+		while(*path=='/') path++;
+		if(!*path) break;
+		length = strcspn(path,"/");
+		if(length>DIR_NAME_MAX) return 0;
+		memcpy(name,path,length);
+		name[length] = 0;
+		path += length;
+
+		inumber = dir_lookup(inumber,name);
+		if(!inumber) return 0;
+	}
+	return inumber;
+}
+
+/*
+	Splits a path into the directory holding its last part, which is returned,
+	and the last part itself, which is copied into name. Returns zero if the
+	directory does not exist or the path has no last part.
+*/
+int dir_parent( const char *path, char *name )
+{
+	char parent[1024];
+	const char *last;
+	int length;
+
+	if(strlen(path)>1 && path[strlen(path)-1]=='/') return 0;
+
+	last = strrchr(path,'/');
+	last = last ? last+1 : path;
+	if(!*last || strlen(last)>DIR_NAME_MAX) return 0;
+
+	length = last-path;
+	if(length>=sizeof(parent)) return 0;
+	memcpy(parent,path,length);
+	parent[length] = 0;
+	strcpy(name,last);
+
+	return dir_resolve(parent);
+}
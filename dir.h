@@ -0,0 +1,34 @@
+#ifndef DIR_H
+#define DIR_H
+
+#define DIR_ROOT        1    // inode of the root directory
+#define DIR_NAME_MAX    255  // longest name in a directory
+#define DIR_BUCKET_SIZE 4096 // bytes in one hash bucket of a directory
+
+/*
+	Position of a walk through a directory with dir_readdir.
+	Set it up with dir_opendir before the first call.
+*/
+struct dir_cursor {
+	int dinumber;
+	int bucket;
+	int offset;
+	int loaded;
+	char block[DIR_BUCKET_SIZE];
+};
+
+int  dir_mkroot();
+int  dir_isdir( int dinumber );
+
+int  dir_mkdir( int dinumber, const char *name );
+int  dir_create( int dinumber, const char *name );
+int  dir_unlink( int dinumber, const char *name );
+int  dir_lookup( int dinumber, const char *name );
+
+int  dir_opendir( int dinumber, struct dir_cursor *cursor );
+int  dir_readdir( struct dir_cursor *cursor, char *name, int *inumber );
+
+int  dir_resolve( const char *path );
+int  dir_parent( const char *path, char *name );
+
+#endif
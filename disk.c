@@ -1,30 +1,372 @@
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+#define MAX_MEMBERS 16
+#define MAX_IOV     64 // stripe units one member job carries, a longer range goes in rounds
+#define PLUG_BLOCKS 256 // writes a plug holds before it has to send them
+#define SCHED_DEPTH 128 // most requests the scheduler holds before it must send one
+#define DEADLINE_READ  500  // ms a queued read may wait before it goes first
+#define DEADLINE_WRITE 5000 // ms for a write
+#define DEADLINE_BATCH 16   // requests swept on from an expired one before deadlines are checked again
+
+/*
+	The disk is one image file, or several striped RAID-0 style: block b lives in
+	stripe unit b/stripe, and the units go round the members in turn. Consecutive
+	units of one member are adjacent in its file, so a range of blocks is one
+	vectored transfer per member. Each member has a thread of its own, so a range
+	spanning several members moves in parallel.
+*/
+
+struct member {
+	int fd;
+	pthread_t thread;
+	pthread_cond_t wake;
+	// pending job, filled in under lock
+	int pending;
+	int write;
+	off_t offset;
+	int niov;
+	struct iovec iov[MAX_IOV];
+	// where the modeled head stopped, as a byte offset in the member
+	off_t head;
+};
+
+static struct member members[MAX_MEMBERS];
+static int nmembers=0;
+static int stripe=1;
 static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+static char *mapping=0; // read-only view of a single image, made by disk_map
+static _Atomic int nreads=0;
+static _Atomic int nwrites=0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static int outstanding=0;
+static int stopping=0;
+
+/*
+	While plugged, block writes wait in a queue instead of going to the image. A block
+	written twice keeps only its last contents, and reads see queued blocks. Unplugging
+	sorts the queue and sends each run of adjacent blocks as one transfer, so a file
+	written a block at a time still reaches the image in large writes.
+*/
+static int plugdepth=0;
+static int nqueued=0;
+static int queuedblock[PLUG_BLOCKS];
+static char queuedata[PLUG_BLOCKS][DISK_BLOCK_SIZE];
+static char staging[PLUG_BLOCKS*DISK_BLOCK_SIZE];
+static int nplugged=0;
+static int nmerged=0;
+
+/*
+	An optional cost model charges each request the time a real device would take, so
+	layouts and caching can be compared even though the image sits in the page cache.
+	A hard disk pays a seek growing linearly with the distance from where its head last
+	stopped plus half a rotation, unless the request starts where the last one ended.
+	Both kinds pay a fixed overhead per request and the transfer at their bandwidth.
+	Each member has a head of its own, and a striped transfer costs what its slowest
+	member does. The time goes on a virtual clock, and is also slept if asked.
+*/
+struct model {
+	const char *name;
+	double overhead;  // ms per request
+	double seekmin;   // ms, to a neighbouring track
+	double seekmax;   // ms, across the whole member
+	double rpm;       // 0 for a device without rotation
+	double bandwidth; // MB/s
+};
+
+static const struct model models[] = {
+	{ "hdd", 0.1, 0.8, 15.0, 7200, 150 },
+	{ "ssd", 0.02, 0, 0, 0, 500 },
+};
+
+static struct model model;
+static int modelon=0;
+static int modelsleep=0;
+static double modeltime=0; // ms
+static int nseeks=0;
+static off_t membersize=1;
+static pthread_mutex_t modellock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	Requests handed to disk_submit wait in the scheduler until it is full or someone
+	waits, and the policy picks which goes next. The synchronous calls go through it
+	too, each submitting its request and waiting, so they are ordered along with
+	whatever was submitted before them; only plugged writes gather in the plug first. FIFO keeps arrival order. C-LOOK sweeps
+	upwards from where the last request ended and jumps back to the lowest block when
+	nothing lies ahead. Deadline sweeps like C-LOOK but first serves any request that has
+	waited past its deadline. Times are on the model's clock, so latency and throughput
+	per policy mean something once a model is set.
+*/
+struct request {
+	int first;
+	int count;
+	int write;
+	char *data;
+	double arrival;  // ms
+	double deadline; // ms
+};
+
+// reads are [0] and writes [1]
+struct schedstats {
+	long long requests[2];
+	long long blocks;
+	double latency[2]; // ms, summed over requests
+	double worst[2];   // ms
+	double busy;       // ms spent transferring
+};
+
+static const char *schedulers[] = { "fifo", "clook", "deadline" };
+
+static struct request requests[SCHED_DEPTH];
+static int nrequests=0;
+static int scheddepth=SCHED_DEPTH;
+static int schedpolicy=DISK_SCHED_CLOOK;
+static int sweep=0; // block after the last request sent
+static int batch=0; // requests left in the deadline policy's current sweep
+static struct schedstats schedstats[3];
+// a background mount scan may read while the filesystem's own thread does, so requests take turns
+static pthread_mutex_t schedlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void io_failed()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
+
+// runs a member job, resuming after short transfers
+static void run_job( struct member *m )
+{
+	struct iovec *iov = m->iov;
+	int niov = m->niov;
+	off_t offset = m->offset;
+
+	while(niov>0) {
+		ssize_t n = m->write ? pwritev(m->fd,iov,niov,offset) : preadv(m->fd,iov,niov,offset);
+		if(n<=0) {
+			if(n<0 && errno==EINTR) continue;
+			io_failed();
+		}
+		offset += n;
+		while(niov>0 && (size_t)n>=iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if(niov>0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static void * member_worker( void *arg )
+{
+	struct member *m = arg;
+
+	pthread_mutex_lock(&lock);
+	while(1) {
+		while(!m->pending && !stopping) pthread_cond_wait(&m->wake,&lock);
+		if(!m->pending) break;
+		pthread_mutex_unlock(&lock);
+
+		run_job(m);
+
+		pthread_mutex_lock(&lock);
+		m->pending = 0;
+		if(--outstanding==0) pthread_cond_signal(&done);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+// ms one request of length bytes at offset takes on member m, which leaves its head after it
+static double model_cost( struct member *m, off_t offset, size_t length )
+{
+	double ms = model.overhead + length / (model.bandwidth*1000);
+
+	if(model.rpm>0 && offset!=m->head) {
+		off_t distance = offset>m->head ? offset-m->head : m->head-offset;
+		ms += model.seekmin + (model.seekmax-model.seekmin) * distance / membersize;
+		ms += 30000 / model.rpm;
+		nseeks++;
+	}
+	m->head = offset + length;
+	return ms;
+}
+
+static void model_wait( double ms )
+{
+	struct timespec ts;
+	long long ns = (long long)(ms*1e6);
+
+	ts.tv_sec = ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	while(nanosleep(&ts,&ts)<0 && errno==EINTR);
+}
+
+// charges one request, in which jobs[i] moves length[i] bytes at offset[i]
+static void model_charge( struct member **jobs, const off_t *offset, const size_t *length, int njobs )
+{
+	double ms, worst = 0;
+	int i;
+
+	pthread_mutex_lock(&modellock);
+	for(i=0;i<njobs;i++) {
+		ms = model_cost(jobs[i],offset[i],length[i]);
+		if(ms>worst) worst = ms;
+	}
+	modeltime += worst;
+	pthread_mutex_unlock(&modellock);
+
+	if(modelsleep) model_wait(worst);
+}
+
+int disk_model( const char *spec )
+{
+	char *list = strdup(spec);
+	char *name, *save;
+	struct model chosen;
+	int sleeping = 0, i, ok = 1;
+
+	name = strtok_r(list,",",&save);
+	if(!name || !strcmp(name,"none")) {
+		free(list);
+		modelon = 0;
+		return 1;
+	}
+
+	for(i=0;i<(int)(sizeof(models)/sizeof(models[0]));i++) {
+		if(!strcmp(name,models[i].name)) break;
+	}
+	if(i==sizeof(models)/sizeof(models[0])) {
+		free(list);
+		return 0;
+	}
+	chosen = models[i];
+
+	// the rest tunes the model: overhead=, seek=, rpm=, bw= and sleep
+	while(ok && (name=strtok_r(0,",",&save))) {
+		char *value = strchr(name,'=');
+		if(!strcmp(name,"sleep")) {
+			sleeping = 1;
+			continue;
+		}
+		if(!value) {
+			ok = 0;
+			break;
+		}
+		*value++ = 0;
+		if(!strcmp(name,"overhead")) chosen.overhead = atof(value);
+		else if(!strcmp(name,"seek")) chosen.seekmax = atof(value);
+		else if(!strcmp(name,"rpm")) chosen.rpm = atof(value);
+		else if(!strcmp(name,"bw")) chosen.bandwidth = atof(value);
+		else ok = 0;
+	}
+	free(list);
+
+	if(!ok || chosen.bandwidth<=0 || chosen.overhead<0 || chosen.seekmax<chosen.seekmin || chosen.rpm<0) return 0;
+
+	model = chosen;
+	modelsleep = sleeping;
+	modelon = 1;
+	return 1;
+}
+
+double disk_time()
+{
+	return modeltime/1000;
+}
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	char *list = strdup(filename);
+	const char *files[MAX_MEMBERS];
+	char *name, *save;
+	int count = 0, result;
+
+	// a comma separated list stripes the disk across its files
+	for(name=strtok_r(list,",",&save);name;name=strtok_r(0,",",&save)) {
+		if(count==MAX_MEMBERS) {
+			free(list);
+			errno = EINVAL;
+			return 0;
+		}
+		files[count++] = name;
+	}
+
+	result = disk_init_striped(files,count,n,DISK_STRIPE_BLOCKS);
+	free(list);
+	return result;
+}
+
+int disk_init_striped( const char **filenames, int nfiles, int n, int stripeblocks )
+{
+	int i, rows;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	if(nfiles<1 || nfiles>MAX_MEMBERS || stripeblocks<1) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	// a single file is not striped, so its image keeps its exact size
+	if(nfiles==1) stripeblocks = 1;
 
+	// every member holds the same number of whole stripe units
+	rows = (n + stripeblocks*nfiles - 1) / (stripeblocks*nfiles);
+
+	for(i=0;i<nfiles;i++) {
+		members[i].fd = open(filenames[i],O_RDWR|O_CREAT,0666);
+		if(members[i].fd<0 || ftruncate(members[i].fd,(off_t)rows*stripeblocks*DISK_BLOCK_SIZE)<0) {
+			int saved = errno;
+			if(members[i].fd>=0) close(members[i].fd);
+			while(--i>=0) close(members[i].fd);
+			errno = saved;
+			return 0;
+		}
+	}
+
+	nmembers = nfiles;
+	stripe = stripeblocks;
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nplugged = 0;
+	nmerged = 0;
+	stopping = 0;
+	modeltime = 0;
+	nseeks = 0;
+	nrequests = 0;
+	sweep = 0;
+	batch = 0;
+	memset(schedstats,0,sizeof(schedstats));
+	membersize = (off_t)rows*stripeblocks*DISK_BLOCK_SIZE;
+	for(i=0;i<nmembers;i++) members[i].head = 0;
+
+	// a single file needs no helpers, every transfer is one call anyway
+	if(nmembers>1) {
+		for(i=0;i<nmembers;i++) {
+			members[i].pending = 0;
+			pthread_cond_init(&members[i].wake,0);
+			pthread_create(&members[i].thread,0,member_worker,&members[i]);
+		}
+	}
 
 	return 1;
 }
@@ -52,41 +394,464 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+// member holding blocknum, and the block's byte offset within that member
+static struct member * locate( int blocknum, off_t *offset )
 {
-	sanity_check(blocknum,data);
+	int unit = blocknum / stripe;
+	*offset = ((off_t)(unit / nmembers) * stripe + blocknum % stripe) * DISK_BLOCK_SIZE;
+	return &members[unit % nmembers];
+}
+
+/*
+	Moves count blocks starting at first. The range is cut into stripe units, each
+	member gets one job for its share, and the members run in parallel. The caller
+	runs the first job itself and hands the rest to the member threads.
+*/
+static void transfer( int first, int count, char *data, int write )
+{
+	struct member *jobs[MAX_MEMBERS];
+	int njobs, i;
+
+	while(count>0) {
+		int blocknum = first;
+
+		njobs = 0;
+		for(i=0;i<nmembers;i++) members[i].niov = 0;
+
+		// take stripe units until the range ends or some member's job is full
+		while(blocknum<first+count) {
+			off_t offset;
+			struct member *m = locate(blocknum,&offset);
+			int length = stripe - blocknum % stripe;
+			if(length>first+count-blocknum) length = first+count-blocknum;
+			if(m->niov==MAX_IOV) break;
+			if(m->niov==0) {
+				m->offset = offset;
+				m->write = write;
+				jobs[njobs++] = m;
+			}
+			m->iov[m->niov].iov_base = data + (long)(blocknum-first)*DISK_BLOCK_SIZE;
+			m->iov[m->niov].iov_len = (size_t)length*DISK_BLOCK_SIZE;
+			m->niov++;
+			blocknum += length;
+		}
+
+		if(modelon) {
+			off_t offsets[MAX_MEMBERS];
+			size_t lengths[MAX_MEMBERS];
+			int j;
+			for(i=0;i<njobs;i++) {
+				offsets[i] = jobs[i]->offset;
+				lengths[i] = 0;
+				for(j=0;j<jobs[i]->niov;j++) lengths[i] += jobs[i]->iov[j].iov_len;
+			}
+			model_charge(jobs,offsets,lengths,njobs);
+		}
+
+		if(njobs>1) {
+			pthread_mutex_lock(&lock);
+			outstanding += njobs-1;
+			for(i=1;i<njobs;i++) {
+				jobs[i]->pending = 1;
+				pthread_cond_signal(&jobs[i]->wake);
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		run_job(jobs[0]);
+
+		if(njobs>1) {
+			pthread_mutex_lock(&lock);
+			while(outstanding>0) pthread_cond_wait(&done,&lock);
+			pthread_mutex_unlock(&lock);
+		}
+
+		data += (long)(blocknum-first)*DISK_BLOCK_SIZE;
+		count -= blocknum-first;
+		first = blocknum;
+	}
+}
+
+static int queue_find( int blocknum )
+{
+	int i;
+	for(i=0;i<nqueued;i++) {
+		if(queuedblock[i]==blocknum) return i;
+	}
+	return -1;
+}
+
+static int compare_queued( const void *a, const void *b )
+{
+	return queuedblock[*(const int*)a] - queuedblock[*(const int*)b];
+}
+
+// copies queued blocks over what was just read from the image
+static void queue_overlay( int first, int count, char *data )
+{
+	int i;
+	for(i=0;i<nqueued;i++) {
+		if(queuedblock[i]>=first && queuedblock[i]<first+count) {
+			memcpy(data+(long)(queuedblock[i]-first)*DISK_BLOCK_SIZE,queuedata[i],DISK_BLOCK_SIZE);
+		}
+	}
+}
+
+// index of the queued request the policy sends next
+static int sched_pick()
+{
+	int i, best = 0, lowest = 0;
+
+	if(schedpolicy==DISK_SCHED_FIFO) return 0;
+
+	if(schedpolicy==DISK_SCHED_DEADLINE && --batch<=0) {
+		for(i=1;i<nrequests;i++) {
+			if(requests[i].deadline<requests[best].deadline) best = i;
+		}
+		if(requests[best].deadline<=modeltime) {
+			batch = DEADLINE_BATCH;
+			return best;
+		}
+	}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	best = -1;
+	for(i=0;i<nrequests;i++) {
+		if(requests[i].first>=sweep && (best<0 || requests[i].first<requests[best].first)) best = i;
+		if(requests[i].first<requests[lowest].first) lowest = i;
+	}
+	return best>=0 ? best : lowest;
+}
+
+// sends request i, caller holds schedlock
+static void sched_send( int i )
+{
+	struct request r = requests[i];
+	struct schedstats *st = &schedstats[schedpolicy];
+	double start, latency;
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	nrequests--;
+	memmove(&requests[i],&requests[i+1],(nrequests-i)*sizeof(struct request));
+
+	start = modeltime;
+	transfer(r.first,r.count,r.data,r.write);
+	latency = modeltime - r.arrival;
+	st->busy += modeltime - start;
+
+	if(r.write) {
+		nwrites += r.count;
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		nreads += r.count;
+		if(nqueued>0) queue_overlay(r.first,r.count,r.data);
 	}
+
+	st->requests[r.write]++;
+	st->blocks += r.count;
+	st->latency[r.write] += latency;
+	if(latency>st->worst[r.write]) st->worst[r.write] = latency;
+	sweep = r.first + r.count;
 }
 
-void disk_write( int blocknum, const char *data )
+static void sched_drain()
+{
+	while(nrequests>0) sched_send(sched_pick());
+}
+
+// queues a request for the policy to order, caller holds schedlock
+static void sched_add( int first, int count, char *data, int write )
+{
+	int i;
+
+	// a request must not pass one it overlaps if either writes
+	for(i=0;i<nrequests;i++) {
+		if((write || requests[i].write) && first<requests[i].first+requests[i].count && requests[i].first<first+count) {
+			sched_drain();
+			break;
+		}
+	}
+
+	if(nrequests==scheddepth) sched_send(sched_pick());
+
+	requests[nrequests].first = first;
+	requests[nrequests].count = count;
+	requests[nrequests].write = write;
+	requests[nrequests].data = data;
+	requests[nrequests].arrival = modeltime;
+	requests[nrequests].deadline = modeltime + (write ? DEADLINE_WRITE : DEADLINE_READ);
+	nrequests++;
+}
+
+/*
+	Sends a request and waits for it, caller holds schedlock. With nothing else submitted
+	there is no order to choose, so it goes straight out; otherwise it joins the rest.
+*/
+static void sched_run( int first, int count, char *data, int write )
+{
+	sched_add(first,count,data,write);
+	if(nrequests==1) {
+		sched_send(0);
+	} else {
+		sched_drain();
+	}
+}
+
+void disk_submit( int first, int count, char *data, int write )
+{
+	if(count<=0) return;
+	sanity_check(first,data);
+	sanity_check(first+count-1,data);
+
+	pthread_mutex_lock(&schedlock);
+	sched_add(first,count,data,write);
+	pthread_mutex_unlock(&schedlock);
+}
+
+void disk_wait()
+{
+	pthread_mutex_lock(&schedlock);
+	sched_drain();
+	pthread_mutex_unlock(&schedlock);
+}
+
+// sends every queued block, adjacent ones together, caller holds schedlock
+static void queue_flush()
+{
+	int order[PLUG_BLOCKS];
+	int i, j, n = nqueued;
+
+	if(nqueued==0) return;
+
+	for(i=0;i<nqueued;i++) order[i] = i;
+	qsort(order,nqueued,sizeof(int),compare_queued);
+
+	// each run gets its own part of staging, so the scheduler may send them in any order
+	for(i=0;i<nqueued;i++) {
+		memcpy(staging+(long)i*DISK_BLOCK_SIZE,queuedata[order[i]],DISK_BLOCK_SIZE);
+	}
+	nqueued = 0;
+
+	for(i=0;i<n;i=j) {
+		for(j=i;j<n && queuedblock[order[j]]==queuedblock[order[i]]+(j-i);j++);
+		sched_add(queuedblock[order[i]],j-i,staging+(long)i*DISK_BLOCK_SIZE,1);
+		nmerged++;
+	}
+	sched_drain();
+}
+
+static void queue_dispatch()
+{
+	pthread_mutex_lock(&schedlock);
+	queue_flush();
+	pthread_mutex_unlock(&schedlock);
+}
+
+// caller holds schedlock
+static void queue_write( int blocknum, const char *data )
+{
+	int i = queue_find(blocknum);
+
+	if(i<0) {
+		if(nqueued==PLUG_BLOCKS) queue_flush();
+		i = nqueued++;
+		queuedblock[i] = blocknum;
+		nplugged++;
+	}
+	memcpy(queuedata[i],data,DISK_BLOCK_SIZE);
+}
+
+int disk_scheduler( int policy, int depth )
+{
+	if(policy<DISK_SCHED_FIFO || policy>DISK_SCHED_DEADLINE || depth<0 || depth>SCHED_DEPTH) return 0;
+
+	disk_wait();
+	schedpolicy = policy;
+	if(depth>0) scheddepth = depth;
+	return 1;
+}
+
+void disk_plug()
+{
+	plugdepth++;
+}
+
+void disk_unplug()
+{
+	if(plugdepth>0 && --plugdepth==0) queue_dispatch();
+}
+
+// a synchronous request joins whatever is submitted, so the policy orders it with the rest
+static void sched_sync( int first, int count, char *data, int write )
+{
+	if(count<=0) return;
+	sanity_check(first,data);
+	sanity_check(first+count-1,data);
+
+	pthread_mutex_lock(&schedlock);
+	sched_run(first,count,data,write);
+	pthread_mutex_unlock(&schedlock);
+}
+
+void disk_read( int blocknum, char *data )
 {
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	pthread_mutex_lock(&schedlock);
+	if(nqueued>0) {
+		int i = queue_find(blocknum);
+		if(i>=0) {
+			memcpy(data,queuedata[i],DISK_BLOCK_SIZE);
+			pthread_mutex_unlock(&schedlock);
+			return;
+		}
+	}
+	sched_run(blocknum,1,data,0);
+	pthread_mutex_unlock(&schedlock);
+}
+
+void disk_write( int blocknum, const char *data )
+{
+	sanity_check(blocknum,data);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	pthread_mutex_lock(&schedlock);
+	if(plugdepth>0) {
+		// a plugged write must not pass a submitted one to the same block
+		sched_drain();
+		queue_write(blocknum,data);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		sched_run(blocknum,1,(char*)data,1);
 	}
+	pthread_mutex_unlock(&schedlock);
+}
+
+void disk_read_blocks( int first, int count, char *data )
+{
+	sched_sync(first,count,data,0);
+}
+
+void disk_write_blocks( int first, int count, const char *data )
+{
+	int i;
+
+	if(count<=0) return;
+	sanity_check(first,data);
+	sanity_check(first+count-1,data);
+
+	pthread_mutex_lock(&schedlock);
+	if(plugdepth>0) {
+		sched_drain();
+		// a range too big to gather goes straight out, after what is queued
+		if(count<PLUG_BLOCKS) {
+			for(i=0;i<count;i++) queue_write(first+i,data+(long)i*DISK_BLOCK_SIZE);
+			pthread_mutex_unlock(&schedlock);
+			return;
+		}
+		queue_flush();
+	}
+	sched_run(first,count,(char*)data,1);
+	pthread_mutex_unlock(&schedlock);
+}
+
+/*
+	Punches count blocks starting at first out of the image files, so they read back as
+	zeros and no longer take up space. Each member's share of the range is contiguous,
+	so it is one fallocate per member. Returns one on success, zero if a member's file
+	system cannot punch holes, in which case the blocks may keep their contents.
+*/
+int disk_discard( int first, int count )
+{
+	off_t start[MAX_MEMBERS], end[MAX_MEMBERS];
+	int blocknum, i;
+
+	if(count<=0) return 1;
+	sanity_check(first,&first);
+	sanity_check(first+count-1,&first);
+
+	// queued writes to the range must not land after the hole is punched
+	queue_dispatch();
+	disk_wait();
+
+	for(i=0;i<nmembers;i++) start[i] = end[i] = -1;
+
+	for(blocknum=first;blocknum<first+count;) {
+		off_t offset;
+		struct member *m = locate(blocknum,&offset);
+		int length = stripe - blocknum % stripe;
+		if(length>first+count-blocknum) length = first+count-blocknum;
+		i = m - members;
+		if(start[i]<0) start[i] = offset;
+		end[i] = offset + (off_t)length*DISK_BLOCK_SIZE;
+		blocknum += length;
+	}
+
+	for(i=0;i<nmembers;i++) {
+		if(start[i]<0) continue;
+		if(fallocate(members[i].fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,start[i],end[i]-start[i])<0) return 0;
+	}
+	return 1;
+}
+
+/*
+	Maps a single image file read-only and returns its first block, the others following in
+	order, or 0 for a striped disk. Reads through the mapping take no locks and are not
+	counted, and writes made while it exists show through it.
+*/
+const char * disk_map()
+{
+	if(nmembers!=1) return 0;
+	if(!mapping) {
+		void *p = mmap(0,(size_t)nblocks*DISK_BLOCK_SIZE,PROT_READ,MAP_SHARED,members[0].fd,0);
+		if(p==MAP_FAILED) return 0;
+		mapping = p;
+	}
+	return mapping;
+}
+
+int disk_members()
+{
+	return nmembers;
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	int i;
+
+	if(nmembers>0) {
+		queue_dispatch();
+		plugdepth = 0;
+		disk_wait();
+
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(nplugged>0) printf("%d plugged block writes sent in %d transfers\n",nplugged,nmerged);
+		if(modelon) printf("%.3f s modeled %s time, %d seeks\n",modeltime/1000,model.name,nseeks);
+		// latencies are on the model's clock, without one there is nothing to say
+		for(i=0;modelon && i<3;i++) {
+			struct schedstats *st = &schedstats[i];
+			int w;
+			if(st->requests[0]+st->requests[1]==0) continue;
+			printf("%s:",schedulers[i]);
+			for(w=0;w<2;w++) {
+				if(st->requests[w]==0) continue;
+				printf(" %lld %s %.2f ms mean %.2f ms worst,",st->requests[w],w ? "writes" : "reads",st->latency[w]/st->requests[w],st->worst[w]);
+			}
+			printf(" %.1f MB/s\n",st->busy>0 ? st->blocks*(double)DISK_BLOCK_SIZE/st->busy/1000 : 0);
+		}
+
+		if(nmembers>1) {
+			pthread_mutex_lock(&lock);
+			stopping = 1;
+			for(i=0;i<nmembers;i++) pthread_cond_signal(&members[i].wake);
+			pthread_mutex_unlock(&lock);
+			for(i=0;i<nmembers;i++) {
+				pthread_join(members[i].thread,0);
+				pthread_cond_destroy(&members[i].wake);
+			}
+		}
+
+		if(mapping) {
+			munmap(mapping,(size_t)nblocks*DISK_BLOCK_SIZE);
+			mapping = 0;
+		}
+		for(i=0;i<nmembers;i++) close(members[i].fd);
+		nmembers = 0;
 	}
 }
-
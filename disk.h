@@ -2,11 +2,29 @@
 #define DISK_H
 
 #define DISK_BLOCK_SIZE 4096
+#define DISK_STRIPE_BLOCKS 16 // default stripe unit when disk_init is given several files
+
+#define DISK_SCHED_FIFO     0
+#define DISK_SCHED_CLOOK    1
+#define DISK_SCHED_DEADLINE 2
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_striped( const char **filenames, int nfiles, int nblocks, int stripeblocks );
 int  disk_size();
+int  disk_members();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_blocks( int first, int count, char *data );
+void disk_write_blocks( int first, int count, const char *data );
+int  disk_discard( int first, int count );
+const char * disk_map();
+void disk_plug();
+void disk_unplug();
+void disk_submit( int first, int count, char *data, int write );
+void disk_wait();
+int  disk_scheduler( int policy, int depth );
+int  disk_model( const char *spec );
+double disk_time();
 void disk_close();
 
 
@@ -0,0 +1,151 @@
+
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define SCHED_REQUESTS 4000 // requests per policy in the scheduler comparison
+
+/*
+	Throughput benchmark for the emulated disk. Runs the same transfer pattern
+	striped over the first 1, 2, 4 ... of the given image files, so the numbers
+	show how aggregate throughput scales as members are added.
+*/
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void run( const char **files, int nfiles, int nblocks, int stripe, int request, int seconds, int writing, int randomly )
+{
+	char *buffer = malloc((long)request*DISK_BLOCK_SIZE);
+	long long blocks = 0;
+	unsigned seed = 1;
+	int first = 0;
+	double start, elapsed, modeled;
+
+	if(!disk_init_striped(files,nfiles,nblocks,stripe)) {
+		printf("couldn't open the image files\n");
+		exit(1);
+	}
+	memset(buffer,'x',(long)request*DISK_BLOCK_SIZE);
+
+	// fill the members first so reads hit real data
+	for(first=0;first+request<=nblocks;first+=request) disk_write_blocks(first,request,buffer);
+
+	first = 0;
+	modeled = disk_time();
+	start = now();
+	do {
+		if(randomly) first = rand_r(&seed) % (nblocks-request+1);
+		else if(first+request>nblocks) first = 0;
+
+		if(writing) disk_write_blocks(first,request,buffer);
+		else disk_read_blocks(first,request,buffer);
+
+		blocks += request;
+		first += request;
+	} while(now()-start<seconds);
+	elapsed = now()-start;
+	modeled = disk_time()-modeled;
+
+	disk_close();
+	printf("%d members: %.1f MB/s",nfiles,blocks*(double)DISK_BLOCK_SIZE/elapsed/1e6);
+	if(modeled>0) printf(", %.1f MB/s modeled",blocks*(double)DISK_BLOCK_SIZE/modeled/1e6);
+	printf("\n\n");
+
+	free(buffer);
+}
+
+/*
+	Mixed random reads and writes, a third of them writes, kept depth deep in the
+	scheduler. Every policy gets the same requests, and disk_close prints its latency
+	and throughput, so the runs compare how the policies order a seek bound load.
+*/
+static void schedule( const char **files, int nfiles, int nblocks, int stripe, int request, int depth )
+{
+	const char *names[] = { "fifo", "clook", "deadline" };
+	char *buffer = malloc((long)request*DISK_BLOCK_SIZE);
+	unsigned seed;
+	int policy, i;
+
+	memset(buffer,'x',(long)request*DISK_BLOCK_SIZE);
+
+	for(policy=DISK_SCHED_FIFO;policy<=DISK_SCHED_DEADLINE;policy++) {
+		if(!disk_init_striped(files,nfiles,nblocks,stripe)) {
+			printf("couldn't open the image files\n");
+			exit(1);
+		}
+		disk_scheduler(policy,depth);
+
+		printf("%s, queue depth %d:\n",names[policy],depth);
+		seed = 1;
+		for(i=0;i<SCHED_REQUESTS;i++) {
+			int first = rand_r(&seed) % (nblocks-request+1);
+			disk_submit(first,request,buffer,rand_r(&seed)%3==0);
+		}
+		disk_close();
+		printf("\n");
+	}
+
+	free(buffer);
+}
+
+int main( int argc, char *argv[] )
+{
+	int nblocks = 65536, stripe = DISK_STRIPE_BLOCKS, request = 256, seconds = 3;
+	int writing = 0, randomly = 0, depth = 0;
+	int opt, nfiles;
+
+	while((opt=getopt(argc,argv,"n:S:r:t:wRm:q:"))!=-1) {
+		switch(opt) {
+			case 'n': nblocks = atoi(optarg); break;
+			case 'S': stripe = atoi(optarg); break;
+			case 'r': request = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'w': writing = 1; break;
+			case 'R': randomly = 1; break;
+			case 'q': depth = atoi(optarg); break;
+			case 'm':
+				if(!disk_model(optarg)) {
+					printf("unknown device model %s\n",optarg);
+					return 1;
+				}
+				break;
+			default: optind = argc+1; break;
+		}
+	}
+
+	if(optind>=argc || nblocks<1 || stripe<1 || request<1 || request>nblocks || depth<0) {
+		printf("use: %s [-n nblocks] [-S stripe blocks] [-r request blocks] [-t seconds] [-w] [-R] [-m model] [-q depth] <image> [image ...]\n",argv[0]);
+		printf("    -w writes instead of reading, -R picks random offsets instead of streaming\n");
+		printf("    -m charges a device model: hdd or ssd, then ,overhead= ,seek= ,rpm= ,bw= or ,sleep\n");
+		printf("    -q compares the schedulers on mixed random requests kept that many deep\n");
+		return 1;
+	}
+
+	if(depth>0) {
+		if(!disk_scheduler(DISK_SCHED_FIFO,depth)) {
+			printf("queue depth %d is too deep\n",depth);
+			return 1;
+		}
+		schedule((const char **)argv+optind,argc-optind,nblocks,stripe,request,depth);
+		return 0;
+	}
+
+	printf("%d blocks, stripe %d blocks, %d block %s %s\n",nblocks,stripe,request,
+		randomly ? "random" : "sequential", writing ? "writes" : "reads");
+
+	for(nfiles=1;nfiles<argc-optind;nfiles*=2) {
+		run((const char **)argv+optind,nfiles,nblocks,stripe,request,seconds,writing,randomly);
+	}
+	run((const char **)argv+optind,argc-optind,nblocks,stripe,request,seconds,writing,randomly);
+
+	return 0;
+}
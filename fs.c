@@ -1,16 +1,33 @@
 #include "fs.h"
 #include "disk.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 #define FS_MAGIC           0xf0f03410 // lets know that there is a file system
-#define INODES_PER_BLOCK   128 // inodes per block
+#define BLOCK_SIZE         blocksize // bytes per block, chosen at format time
+#define INODES_PER_BLOCK   inodesperblock // inodes per block
 #define POINTERS_PER_INODE 5 // number of direct pointers in inode
-#define POINTERS_PER_BLOCK 1024 // number of pointers to be found in an indirect block
+#define POINTERS_PER_BLOCK pointersperblock // number of pointers to be found in an indirect block
+#define BLOCKS_PER_FILE    (POINTERS_PER_INODE + POINTERS_PER_BLOCK) // largest logical block count of a file
+#define MAX_FILE_SIZE      (BLOCKS_PER_FILE * BLOCK_SIZE) // about 1 GB with 64 KB blocks, so it fits an int
+#define MAX_POINTERS_PER_BLOCK (FS_MAX_BLOCK_SIZE / (int)sizeof(int))
+#define MAX_BLOCKS_PER_FILE    (POINTERS_PER_INODE + MAX_POINTERS_PER_BLOCK) // sizes arrays that hold a whole file's map
+
+#define FS_FLAG_COMPRESS   1 // file data is stored in compressed clusters
+#define FS_FLAG_DEDUP      2 // identical data blocks are shared between files
+#define CLUSTER_BLOCKS     4 // logical blocks compressed together
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define MAX_CLUSTER_SIZE   (CLUSTER_BLOCKS * FS_MAX_BLOCK_SIZE)
 
 /*
 	Questions for Jermaine:
@@ -32,633 +49,3992 @@
 
 // Globals
 int ismounted =  0;
-int *freeblockbitmap;
+int *freeblockbitmap; // references to each block, 0 if free and above 1 for blocks shared by dedup or snapshots
+
+/*
+	A snapshot is a frozen copy of the inode table. Its map lists the block holding each of its
+	inode blocks, 0 while it still shares the live inode block. The map is split into blocks of
+	POINTERS_PER_BLOCK entries, and mapblock lists them, 0 for one whose entries are all shared.
+	Both are only allocated when an inode block is first copied, so taking a snapshot writes
+	nothing but the superblock.
+*/
+struct fs_snapshot {
+	int mapblock; // block listing the map blocks, 0 while every inode block is shared
+	int created;
+	char name[FS_SNAPSHOT_NAME]; // empty if the slot is unused
+};
+
+#define WARM_MAX 64 // blocks in the superblock's warm-up list
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int flags; // FS_FLAG_* bits chosen at format time
+	int blocksize; // bytes per block, 0 on images from before it was recorded
+	struct fs_snapshot snapshots[FS_SNAPSHOT_MAX];
+	int nwarm; // entries in warm, 0 on images from before it was recorded
+	int warm[WARM_MAX]; // hottest indirect blocks at the last unmount, read back at mount
 };
 
+#define INODE_FILE 1 // isvalid of an inode in use
+#define INODE_DIR  2 // isvalid of an inode in use as a directory
+
 struct fs_inode {
-	int isvalid;
+	int isvalid; // 0 if free, else INODE_FILE or INODE_DIR
 	int size;
 	int direct[POINTERS_PER_INODE];
 	int indirect;
 };
 
+int inodeused(struct fs_inode *inode){
+	return inode->isvalid == INODE_FILE || inode->isvalid == INODE_DIR;
+}
+
+// big enough for the largest block size, only the first BLOCK_SIZE bytes are used
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
+	struct fs_inode inode[FS_MAX_BLOCK_SIZE / sizeof(struct fs_inode)];
+	int pointers[MAX_POINTERS_PER_BLOCK];
+	char data[FS_MAX_BLOCK_SIZE];
 };
 
+// geometry of the filesystem, set from the superblock by setgeometry
+int blocksize = DISK_BLOCK_SIZE;
+int inodesperblock = DISK_BLOCK_SIZE / sizeof(struct fs_inode);
+int pointersperblock = DISK_BLOCK_SIZE / sizeof(int);
+int sectorsperblock = 1; // disk blocks making up one filesystem block
+
+// copy of the superblock taken at mount time
+struct fs_superblock superblock;
+// lowest inode number that might be free
+int freeinodehint = 0;
+// next inode fs_defrag looks at, so a call that runs out of budget is carried on by the next one
+int defragcursor = 1;
+// inode block maps of every snapshot, indexed like superblock.snapshots, and the blocks holding them
+int *snapmaps[FS_SNAPSHOT_MAX];
+int *snapindexes[FS_SNAPSHOT_MAX];
+// snapshot the filesystem was mounted from, -1 for the live filesystem
+int mountedsnapshot = -1;
+
 /*
-	Creates a new filesystem on the disk, destroying any data already present. 
-	Sets aside ten percent of the blocks for inodes, clears the inode table, and writes the superblock. 
-	Returns one on success, zero otherwise. 
-	Note that formatting a filesystem does not cause it to be mounted. 
-	Also, an attempt to format an already-mounted disk should do nothing and return failure.
+	Sets the block geometry for a filesystem with blocks of size bytes, 0 meaning the
+	disk's own block size. Returns one on success, zero if size is not a power of two
+	from DISK_BLOCK_SIZE to FS_MAX_BLOCK_SIZE.
 */
-int checkinode(int inumber){
-	union fs_block block;
-	disk_read(0,block.data);
-	int currblock;
-	for(currblock = 1; currblock < block.super.nblocks; currblock++){
-		disk_read(currblock, block.data);
-		int currinode;
-		for(currinode = 1; currinode < INODES_PER_BLOCK; currinode++){
-			// check if inumber is same as the given inode
-			if(currinode == inumber){
-				// check if valid 
-				if(block.inode[currinode].isvalid == 1){
-					return 1;
-				}
-			}
-		}
+int setgeometry(int size){
+	if(size == 0){
+		size = DISK_BLOCK_SIZE;
 	}
-	return 0;
+	if(size < DISK_BLOCK_SIZE || size > FS_MAX_BLOCK_SIZE || (size & (size - 1))){
+		return 0;
+	}
+	blocksize = size;
+	inodesperblock = size / sizeof(struct fs_inode);
+	pointersperblock = size / sizeof(int);
+	sectorsperblock = size / DISK_BLOCK_SIZE;
+	return 1;
 }
 
-int fs_format()
-{
-	if(ismounted == 0){
-		union fs_block oldBlock;
-		disk_read(0,oldBlock.data);
-
-		if(oldBlock.super.magic == FS_MAGIC){
-			int currblock;
-			for(currblock = 1; currblock < oldBlock.super.nblocks; currblock++){
-				disk_read(currblock, oldBlock.data);
-				int currinode;
-				// change all of the inodes to not created destroying the data
-				for(currinode = 0; currinode < INODES_PER_BLOCK; currinode++){
-					oldBlock.inode[currinode].isvalid = 0;
-					int currinodeblock;
-					// destroying direct data blocks
-					for(currinodeblock = 0; currinodeblock < POINTERS_PER_INODE; currinodeblock++){
-						oldBlock.inode[currinode].direct[currinodeblock] = 0;
-					}
-					// deleting indirect data blocks
-					if(oldBlock.inode[currinode].indirect > 0){
-						union fs_block indirectblock;
-						disk_read(oldBlock.inode[currinode].indirect, indirectblock.data);
-						oldBlock.inode[currinode].indirect = 0;
-						int currpointer;
-						for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
-							indirectblock.pointers[currpointer] = 0;
-						}
-					}
-				}
-				disk_write(currblock, oldBlock.data);
-			}
-		}
-
-		int numBlocks = disk_size();
-		int percentage = numBlocks/10; 
+/*
+	Block buffers. A union fs_block is sized for the largest block size, too big to keep
+	several on the stack of a worker thread, so functions take page aligned buffers from a
+	pool and give them back when done. Released buffers wait on a free list, chained through
+	their first bytes, so the pool only grows to the most buffers ever in use at once. The
+	block map cache takes its buffers from the same pool, and the alignment lets a buffer
+	go to the disk as it is, even one opened with O_DIRECT.
+*/
+#define BUFFER_ALIGN 4096
 
-		union fs_block newBlock;
+struct bufferpool {
+	int size;
+	void *free; // released buffers, each starting with a pointer to the next
+	int count; // buffers allocated, in use or free
+	pthread_mutex_t lock;
+};
 
-		newBlock.super.magic = FS_MAGIC;
-		newBlock.super.nblocks = numBlocks;
-		newBlock.super.ninodeblocks = percentage;
-		newBlock.super.ninodes = percentage*INODES_PER_BLOCK;
+struct bufferpool blockpool = { FS_MAX_BLOCK_SIZE, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+struct bufferpool clusterpool = { MAX_CLUSTER_SIZE, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+struct bufferpool mappool = { MAX_BLOCKS_PER_FILE * sizeof(int), 0, 0, PTHREAD_MUTEX_INITIALIZER };
 
-		// write the superblock to disk, will be the initial block
-		disk_write(0, newBlock.data);
+void *poolget(struct bufferpool *pool){
+	void *buffer;
+	pthread_mutex_lock(&pool->lock);
+	buffer = pool->free;
+	if(buffer){
+		pool->free = *(void **)buffer;
 	}
-	else if(ismounted == 1){
-		printf("Disk already mounted\n");
+	else{
+		if(posix_memalign(&buffer, BUFFER_ALIGN, pool->size) != 0){
+			printf("Error: out of memory for block buffers\n");
+			abort();
+		}
+		pool->count++;
 	}
-	return 0;
+	pthread_mutex_unlock(&pool->lock);
+	return buffer;
 }
 
-void fs_debug()
-{
-	union fs_block block;
+void poolput(struct bufferpool *pool, void *buffer){
+	pthread_mutex_lock(&pool->lock);
+	*(void **)buffer = pool->free;
+	pool->free = buffer;
+	pthread_mutex_unlock(&pool->lock);
+}
 
-	disk_read(0,block.data);
+/* A block buffer, its contents left over from its last user. */
+union fs_block *getblock(){
+	return poolget(&blockpool);
+}
 
-	printf("superblock:\n");
-	printf("\t%d blocks\n",block.super.nblocks);
-	printf("\t%d inode blocks\n",block.super.ninodeblocks);
-	printf("\t%d inodes\n",block.super.ninodes);
+void putblock(union fs_block *block){
+	poolput(&blockpool, block);
+}
 
-	if(block.super.magic == FS_MAGIC){
-		// Set to 1 because we already read the super block
-		int currblock;
-		for(currblock = 1; currblock < block.super.nblocks; currblock++){
-			// must check that data points to 4KB of memory
-			disk_read(currblock, block.data);
-			int currinode;
-			for(currinode = 1; currinode < INODES_PER_BLOCK; currinode++){
-				// check if the inode is actually created
-				if(block.inode[currinode].isvalid == 1){
-					printf("inode: %d\n", currinode);
-					printf("\tsize: %d bytes\n", block.inode[currinode].size);
-					int size;
-					size = block.inode[currinode].size;
-					// place check here to see if the array is empty
-					printf("\tdirect blocks: ");
-					int currinodeblock;
-					for(currinodeblock = 0; currinodeblock < POINTERS_PER_INODE; currinodeblock++){
-						if(block.inode[currinode].direct[currinodeblock] == 0){
-							continue;
-						}
-						printf("%d ", block.inode[currinode].direct[currinodeblock]);
-					}
-					printf("\n");
-					if(block.inode[currinode].indirect > 0){
-						printf("\tindirect block: %d\n", block.inode[currinode].indirect);
-						printf("\tindirect data blocks: ");
-						union fs_block indirectblock;
-						disk_read(block.inode[currinode].indirect, indirectblock.data);
-						int currpointer;
-						for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
-							if(indirectblock.pointers[currpointer] == 0){
-								continue;
-							}
-							printf("%d ", indirectblock.pointers[currpointer]);
-						}
-						printf("\n");
-					}
-				}
-			}
-		}
-	}	
+/* A buffer for a whole compressed cluster. */
+char *getcluster(){
+	return poolget(&clusterpool);
 }
 
-int fs_mount()
-{
-	union fs_block block;
+void putcluster(char *buffer){
+	poolput(&clusterpool, buffer);
+}
 
-	disk_read(0, block.data);
+/* Room for the block map of the largest file. */
+int *getmap(){
+	return poolget(&mappool);
+}
 
-	// check if the filesystem is present
-	if(block.super.magic == FS_MAGIC){
-		freeblockbitmap = calloc(block.super.nblocks, sizeof(int));
-		// go through each inode block and check every inode 1 if in use 0 otherwise
-		// if data block is 0 then it is not being used, anything else and it is being used
-		int currblock;
-		for(currblock = 1; currblock <= block.super.ninodeblocks; currblock++){
-			union fs_block tempBlock;
-			// printf("blocks: %d\n",  block.super.ninodeblocks);
-			// printf("InodeBlock = %d\n", currblock);
-			freeblockbitmap[currblock] = 1;
-			disk_read(currblock, tempBlock.data);
-			int currinode;
-			for(currinode = 1; currinode < INODES_PER_BLOCK; currinode++){
-				// check if inode is actually created
-				if(tempBlock.inode[currinode].isvalid == 1){
-					int currinodeblock;
-					for(currinodeblock = 0; currinodeblock < POINTERS_PER_INODE; currinodeblock++){
-						// if the current data block is not being used 
-						if(tempBlock.inode[currinode].direct[currinodeblock] == 0){
-							freeblockbitmap[tempBlock.inode[currinode].direct[currinodeblock]] = 0;
-							continue;
-						}
-						freeblockbitmap[tempBlock.inode[currinode].direct[currinodeblock]] = 1;
-					}
-					if(tempBlock.inode[currinode].indirect > 0){
-						union fs_block indirectblock;
-						freeblockbitmap[tempBlock.inode[currinode].indirect] = 1;
-						disk_read(tempBlock.inode[currinode].indirect, indirectblock.data);
-						int currpointer;
-						for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
-							if(indirectblock.pointers[currpointer] == 0){
-								freeblockbitmap[indirectblock.pointers[currpointer]] = 0;
-								continue;
-							}
-							freeblockbitmap[indirectblock.pointers[currpointer]] = 1;
-						}
-					}
-				}
-			}
-		// printf("currblock = %d ninodeblocks = %d\n", currblock, block.super.ninodeblocks);
-		}
+void putmap(int *map){
+	poolput(&mappool, map);
+}
+
+/*
+	Read-only mounts. With FS_MOUNT_READONLY the image is mapped and every read copies
+	straight out of the mapping, bypassing the disk's locks, the block map cache and the
+	buffer pool, so fs_read and fs_getsize can run on any number of threads at once. Nothing
+	is written while mapped, so the reads need no ordering either.
+*/
+const char *mapped = 0; // the image while mounted read-only, 0 otherwise
+const char zeroblock[FS_MAX_BLOCK_SIZE];
+pthread_key_t clusterkey;
+pthread_once_t clusteronce = PTHREAD_ONCE_INIT;
+
+/* Block blocknum in the mapping, a block of zeros if a corrupt pointer leaves the disk. */
+const char *mappedblock(int blocknum){
+	if(blocknum <= 0 || blocknum >= superblock.nblocks){
+		return zeroblock;
 	}
-	ismounted = 1;
-	/*
-	int i;
-	for(i = 0; i < block.super.nblocks; i++){
-		printf("Inodenumber %d: %d\n", i,freeblockbitmap[i]);
-	}*/
-	return ismounted;
+	return mapped + (size_t)blocknum*BLOCK_SIZE;
 }
 
-// to run from here on out you must first mount the disk
-int fs_create()
-{
-	// check to see if it ismounted
-	if(ismounted){
-		union fs_block block;
-		disk_read(0,block.data);
-		if(block.super.magic == FS_MAGIC){
-			int currblock;
-			for(currblock = 1; currblock < block.super.nblocks; currblock++){
-				disk_read(currblock, block.data);
-				int currinode;
-				for(currinode = 1; currinode < INODES_PER_BLOCK; currinode++){
-					// inode already created
-					if(block.inode[currinode].isvalid == 1){
-						continue;
-					}
-					// inode not created, so create it
-					block.inode[currinode].isvalid = 1;
-					block.inode[currinode].size = 0; // set the length to be 0
-					/* zeroing out direct blocks and indirect blocks */
-					int directblock;
-					for(directblock = 0; directblock < POINTERS_PER_INODE; directblock++){
-						block.inode[currinode].direct[directblock] = 0;
-					}
-					block.inode[currinode].indirect = 0;
-					disk_write(currblock, block.data);
-					return currinode;
-				}
-			}
+void makeclusterkey(){
+	pthread_key_create(&clusterkey, free);
+}
+
+/* Two cluster buffers belonging to the calling thread, for decompressing without the pool. */
+char *threadclusters(){
+	char *buffer;
+	pthread_once(&clusteronce, makeclusterkey);
+	buffer = pthread_getspecific(clusterkey);
+	if(!buffer){
+		if(posix_memalign((void **)&buffer, BUFFER_ALIGN, 2*MAX_CLUSTER_SIZE) != 0){
+			printf("Error: out of memory for block buffers\n");
+			abort();
 		}
+		pthread_setspecific(clusterkey, buffer);
 	}
-	else{
-		printf("Error: Disk not mounted\n");
+	return buffer;
+}
+
+/* Prints why and returns one if the mount cannot change. */
+int readonlymount(){
+	if(mountedsnapshot >= 0){
+		printf("Error: snapshot is mounted read-only\n");
+		return 1;
+	}
+	if(mapped){
+		printf("Error: filesystem is mounted read-only\n");
+		return 1;
 	}
 	return 0;
 }
 
+/* Whole-block copies and clears, each block size with its own constant length like hashblock. */
+void copyblock(char *dst, const char *src){
+	switch(BLOCK_SIZE){
+		case 4096: memcpy(dst, src, 4096); break;
+		case 8192: memcpy(dst, src, 8192); break;
+		case 16384: memcpy(dst, src, 16384); break;
+		case 32768: memcpy(dst, src, 32768); break;
+		default: memcpy(dst, src, 65536); break;
+	}
+}
 
-int fs_delete( int inumber )
-{
-	if(ismounted){
-		if(!(checkinode(inumber))){
-			printf("Error invalid inumber\n");
-			return 0;
-		}
-		union fs_block block;
-		disk_read(0,block.data);
-		if(block.super.magic == FS_MAGIC){
-			int currblock;
-			for(currblock = 1; currblock < block.super.nblocks; currblock++){
-				disk_read(currblock, block.data);
-				int currinode;
-				for(currinode = 1; currinode < INODES_PER_BLOCK; currinode++){
-					// check if inumber is same as the given inode
-					if(currinode == inumber){
-						// check if valid 
-						if(block.inode[currinode].isvalid == 1){
-							block.inode[currinode].isvalid = 0;
-							int currinodeblock;
-							for(currinodeblock = 0; currinodeblock < POINTERS_PER_INODE; currinodeblock++){
-								freeblockbitmap[block.inode[currinode].direct[currinodeblock]] = 0; // free bitmap
-								block.inode[currinode].direct[currinodeblock] = 0; // free the direct block
-							}
-							// free the indirect blocks
-							// deleting indirect data blocks
-							if(block.inode[currinode].indirect > 0){
-								union fs_block indirectblock;
-								disk_read(block.inode[currinode].indirect, indirectblock.data);
-								// block.inode[currinode].indirect = 0;
-								int currpointer;
-								for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
-									freeblockbitmap[indirectblock.pointers[currpointer]] = 0;
-									indirectblock.pointers[currpointer] = 0;
-								}
-								disk_write(block.inode[currinode].indirect, indirectblock.data);
-								block.inode[currinode].indirect = 0;
-							}
-						}
-					}
-				}
-				disk_write(currblock, block.data);
-				return 1;
-			}
-		}
+void blankblock(char *dst){
+	switch(BLOCK_SIZE){
+		case 4096: memset(dst, 0, 4096); break;
+		case 8192: memset(dst, 0, 8192); break;
+		case 16384: memset(dst, 0, 16384); break;
+		case 32768: memset(dst, 0, 32768); break;
+		default: memset(dst, 0, 65536); break;
+	}
+}
+
+/* Reads filesystem block blocknum, which is sectorsperblock disk blocks. */
+void readblock(int blocknum, char *data){
+	if(mapped){
+		copyblock(data, mappedblock(blocknum));
+	}
+	else if(sectorsperblock == 1){
+		disk_read(blocknum, data);
 	}
 	else{
-		printf("Error: Disk not mounted\n");
+		disk_read_blocks(blocknum*sectorsperblock, sectorsperblock, data);
 	}
-	// check to see if it ismounted
-	return 0;
 }
 
-int fs_getsize( int inumber )
-{
-	// check to if ismounted
-	if(ismounted){
-		if(!(checkinode(inumber))){
-			printf("Error: invalid inumber\n");
-			return 0;
-		}
-		union fs_block block;
-		disk_read(0, block.data);
-		if(block.super.magic == FS_MAGIC){
-			int currblock;
-			for(currblock = 1; currblock < block.super.nblocks; currblock++){
-				disk_read(currblock, block.data);
-				int currinode;
-				for(currinode = 0; currinode < INODES_PER_BLOCK; currinode++){
-					// check that current inode numbeer is equal to our inumber
-					if(currinode == inumber){
-						if(block.inode[currinode].isvalid == 1){
-							return block.inode[currinode].size;
-						}
-					}
-				}
-			}
-		}
+void writeblock(int blocknum, const char *data){
+	if(sectorsperblock == 1){
+		disk_write(blocknum, data);
 	}
 	else{
-		printf("Error: disk not mounted\n");
+		disk_write_blocks(blocknum*sectorsperblock, sectorsperblock, data);
 	}
-	return -1;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
-{
-	if(ismounted){
-		if(!(checkinode(inumber))){
-			printf("Error: invalid inumber\n");
-			return 0;
+/* Reads count filesystem blocks starting at first in one transfer. */
+void readblockrun(int first, int count, char *data){
+	if(mapped){
+		int i;
+		for(i = 0; i < count; i++){
+			copyblock(data + (size_t)i*BLOCK_SIZE, mappedblock(first + i));
 		}
-		// overall inode
-		struct fs_inode masterinode;
-
-		// resetting the data
-		data[0] = '\0';
-
-		/* Loading the iNode */
-		int inodeblock = inumber/INODES_PER_BLOCK + 1;
-		int inodenum = inumber%INODES_PER_BLOCK;
-		// printf("%d\n", inodenum);
-		union fs_block tempBlock;
-		disk_read(inodeblock, tempBlock.data);
-		// printf("Disk read done\n");
-		memcpy(&masterinode, &tempBlock.inode[inodenum], sizeof(struct fs_inode));
-		// printf("Mem copy done\n");
+		return;
+	}
+	disk_read_blocks(first*sectorsperblock, count*sectorsperblock, data);
+}
 
-		// check if the offset is greater than the size of the inode if so then break
-		if(offset > masterinode.size){
-			return 0;
-		}
-		// printf("past check\n");
+/* Writes count filesystem blocks starting at first in one transfer. */
+void writeblockrun(int first, int count, const char *data){
+	disk_write_blocks(first*sectorsperblock, count*sectorsperblock, data);
+}
 
-		/* Computing Length of Bytes We are Going to Read */
-		int actlength;
-		// iNode size greater than what we want to read
-		if(length + offset > masterinode.size){
-			actlength = masterinode.size - offset; 
-		}
-		else{
-			actlength = length; 
-		}
-		int bytesleft = actlength;
+/* Blocks in the map of a snapshot of an inode table ninodeblocks long. */
+int snapmapblocks(int ninodeblocks){
+	return (ninodeblocks + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+}
 
-		// check if offset greater than size of master inode
-		int currblock = offset / DISK_BLOCK_SIZE; // current block
-		int curroffset = offset % DISK_BLOCK_SIZE; // offset within the given block
-		int currblocknum; // block number that is pointed to
+/* Returns one if the superblock slot snap holds a snapshot. */
+int snapshotused(const struct fs_snapshot *snap){
+	return snap->name[0] != 0;
+}
 
-		// loop through the data
-		while(bytesleft > 0){
-			if(currblock > POINTERS_PER_INODE + POINTERS_PER_BLOCK){
-				break;
-			}
-			if(strlen(data) > length){
-				return 0;
-			}
-			if(currblock >= POINTERS_PER_INODE){
-				// printf("in if\n");
-				/* taking care of indirect block */
-				int currindirectblock = masterinode.indirect;
-				union fs_block indirectBufferBlock;
-				disk_read(currindirectblock, indirectBufferBlock.data);
-				/* find the offset */
-				currblocknum = indirectBufferBlock.pointers[currblock - POINTERS_PER_INODE];
-			}
-			else{
-				currblocknum = masterinode.direct[currblock];
-			}
+/* Block holding inode block index of a snapshot with map. */
+int snapinodeblock(const int *map, int index){
+	return map[index] != 0 ? map[index] : index + 1;
+}
 
-			/* Reading Data */
-			// printf("reading data\n");
-			union fs_block bufferBlock;
-			int bufferLength = DISK_BLOCK_SIZE - curroffset;
-			int lengthToCopy;
-			if(bytesleft > bufferLength){
-				lengthToCopy = bufferLength;
-			}
-			else{
-				lengthToCopy = bytesleft;
-			}
-			if(strlen(data) + lengthToCopy == length){
-				lengthToCopy-=1;
-			}
-			// printf("before diskread\n");
-			disk_read(currblocknum, bufferBlock.data);
-			// printf("before strncat\n");
-			// printf("%d %d", curroffset, lengthToCopy);
-			// printf("Sum: %d\n", (curroffset + lengthToCopy));
-			// printf("poop\n");
-			// printf("LENGTH TO COPY %d", lengthToCopy);
-			// printf("%lu %lu %d", strlen(data), strlen(bufferBlock.data + curroffset), lengthToCopy);
-			strncat(data, bufferBlock.data + curroffset, lengthToCopy);
-			// printf("after strncat\n");
-			if(lengthToCopy < bufferLength){
-				bytesleft = 0;
-			}
-			else{
-				bytesleft = bytesleft - bufferLength;
-			}
-			// printf("past getting bytesleft\n");
+/* Zeroed memory for a snapshot map, a mount cannot go on without it. */
+void *snapalloc(size_t size){
+	void *p = calloc(1, size);
+	if(!p){
+		printf("Error: out of memory for a snapshot map\n");
+		abort();
+	}
+	return p;
+}
 
-			curroffset = 0;
-			currblock+=1;
+/*
+	Loads the map of the snapshot in slot and the list of blocks holding it, reading only the
+	map blocks that exist. The map is rounded up to whole blocks so they can be written back.
+*/
+void loadsnapmap(int slot){
+	int nmap = snapmapblocks(superblock.ninodeblocks);
+	int mapblock = superblock.snapshots[slot].mapblock;
+	int k;
+	snapmaps[slot] = snapalloc((size_t)nmap*BLOCK_SIZE);
+	snapindexes[slot] = snapalloc(BLOCK_SIZE);
+	if(mapblock == 0){
+		return;
+	}
+	readblock(mapblock, (char *)snapindexes[slot]);
+	for(k = 0; k < nmap; k++){
+		if(snapindexes[slot][k] != 0){
+			readblock(snapindexes[slot][k], (char *)(snapmaps[slot] + k*POINTERS_PER_BLOCK));
 		}
-		return actlength - bytesleft;
 	}
-	else{
-		printf("Error: disk not mounted\n");
+}
+
+/* Block holding inode inumber in the mounted inode table. */
+int inodeblocknum(int inumber){
+	if(mountedsnapshot >= 0){
+		return snapinodeblock(snapmaps[mountedsnapshot], inumber/INODES_PER_BLOCK);
 	}
-	return 0;
+	return inumber/INODES_PER_BLOCK + 1;
 }
 
-int findfreeblock(){
-	union fs_block block;
-	disk_read(0, block.data);
-	int i;
-	for(i = 1; i < block.super.nblocks; i++){
-		if(freeblockbitmap[i] == 0){
-			// printf("free = %d\n", i);
-			/* updating the bitmap */
-			freeblockbitmap[i] = 1;
-			return i;
-		}
+#define INODES_PER_SECTOR (DISK_BLOCK_SIZE / (int)sizeof(struct fs_inode))
+
+/* Disk block holding inode inumber within its inode block, so large blocks are not read whole for one inode. */
+int inodesector(int inumber, int blocknum){
+	return blocknum*sectorsperblock + (inumber%INODES_PER_BLOCK) / INODES_PER_SECTOR;
+}
+
+/*
+	Append stream. fs_append keeps the inode of the file it last appended to here, its size and
+	pointers ahead of the disk, along with the contents of its partial last block, so a run of
+	appends neither reloads the inode nor reads the tail back. loadinode serves the inode from
+	here and saveinode ends the stream, so the other calls see and keep the appended data.
+	Anything that reads inode blocks whole calls appendflush first.
+
+	The stream also holds a run of blocks ahead of the tail of each file appended to lately,
+	marked in use but not yet mapped, so files appended to in turn each grow in a run of their
+	own whatever the allocation policy. appendflush lets them go, and so does allocblock
+	before it reports the disk full.
+*/
+#define APPEND_HELD 8 // files with blocks held ahead of their tail
+
+struct appendhold {
+	int inumber; // 0 if the slot is unused
+	int next; // next held block
+	int count; // blocks left from next
+	unsigned lastuse;
+};
+
+struct appendstream {
+	int inumber; // file being appended to, 0 if none
+	struct fs_inode inode;
+	union fs_block *tail; // the last block up to inode.size
+	struct appendhold held[APPEND_HELD];
+	unsigned clock;
+};
+struct appendstream appending;
+
+/* Reads inode inumber out of its inode block. */
+void loadinode(int inumber, struct fs_inode *inode){
+	struct fs_inode sector[INODES_PER_SECTOR];
+	if(appending.inumber != 0 && appending.inumber == inumber){
+		*inode = appending.inode;
+		return;
 	}
-	/* no free block found */
-	return -1;
+	if(mapped){
+		memcpy(inode, mappedblock(inodeblocknum(inumber)) + (inumber%INODES_PER_BLOCK)*sizeof(struct fs_inode), sizeof(struct fs_inode));
+		return;
+	}
+	disk_read(inodesector(inumber, inodeblocknum(inumber)), (char *)sector);
+	memcpy(inode, &sector[inumber%INODES_PER_SECTOR], sizeof(struct fs_inode));
 }
 
-int findfreeindirectblock(struct fs_inode *inode){
-	int currblocknum = findfreeblock();
-	if(currblocknum == -1){
-		return -1;
+/* Writes inode inumber back into its inode block. */
+void saveinode(int inumber, struct fs_inode *inode){
+	struct fs_inode sector[INODES_PER_SECTOR];
+	int sectornum = inodesector(inumber, inumber/INODES_PER_BLOCK + 1);
+	if(appending.inumber != 0 && appending.inumber == inumber){
+		appending.inumber = 0;
+		putblock(appending.tail);
 	}
-	inode->indirect = currblocknum;
-	union fs_block block;
-	disk_read(inode->indirect, block.data);
-	int currpointer;
-	for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
-		/* make sure no garbage values contained */
-		block.pointers[currpointer] = 0;
-	}
-	disk_write(inode->indirect, block.data);
-	return inode->indirect;
+	disk_read(sectornum, (char *)sector);
+	memcpy(&sector[inumber%INODES_PER_SECTOR], inode, sizeof(struct fs_inode));
+	disk_write(sectornum, (char *)sector);
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
-{	
-	if(ismounted){
-		// check inode
-		if(!(checkinode(inumber))){
-			printf("Error: invalid inumber\n");
-			return 0;
-		}
+/*
+	Block map cache. The direct pointers come with the inode, so the indirect block is the only
+	read needed to turn a file offset into a block number. Recently used indirect blocks stay
+	here, in a slot picked by block number, and writeblockmap writes through so they never go
+	stale. An entry is dropped when its block is freed, since the block may come back as data.
+*/
+#define MAPCACHE_SLOTS 64
+int mapcacheblock[MAPCACHE_SLOTS]; // indirect block held by each slot, 0 if empty
+int *mapcachepointers[MAPCACHE_SLOTS];
+int mapcacheuses[MAPCACHE_SLOTS]; // hits since the slot was filled, to pick what to save
 
-		// overall inode
-		struct fs_inode masterinode;
+/*
+	Hit counts since mount. The rate over each window of MAPCACHE_WINDOW lookups shows how
+	fast a cold cache recovers, so the first window and the first to reach MAPCACHE_WARM
+	are kept along with the totals.
+*/
+#define MAPCACHE_WINDOW 256
+#define MAPCACHE_WARM   0.9
 
-		/* Loading the iNode */
-		int inodeblock = inumber/INODES_PER_BLOCK + 1;
-		int inodenum = inumber%INODES_PER_BLOCK;
-		// printf("%d\n", inodenum);
-		union fs_block tempBlock;
-		disk_read(inodeblock, tempBlock.data);
-		// printf("Disk read done\n");
-		memcpy(&masterinode, &tempBlock.inode[inodenum], sizeof(struct fs_inode));
-		// printf("Mem copy done\n");
+struct mapcachestats {
+	long long lookups;
+	long long hits;
+	int windowhits;
+	double firstwindow; // hit rate of the first window, -1 until it is full
+	long long warmafter; // lookups until a window reached MAPCACHE_WARM, 0 if none has
+	int warmed; // blocks prefetched at mount
+	int warmreads; // transfers the prefetch took
+	double warmms; // wall time of the prefetch
+};
+struct mapcachestats mapstats;
 
-		// check if the offset is greater than the size of the inode if so then break
-		if(offset > masterinode.size){
-			return 0;
+/*
+	Indirect blocks a background mount prefetched for the warm-up. The scan thread fills them
+	and sets warmready, and the thread using the cache moves them in by mapcacheinstall.
+*/
+int warmblocks[WARM_MAX];
+int *warmpointers[WARM_MAX];
+int nwarmblocks = 0;
+_Atomic int warmready = 0;
+
+/* Moves prefetched blocks into their slots. They are current, nothing can change an indirect block before the scan is joined. */
+void mapcacheinstall(){
+	int i;
+	for(i = 0; i < nwarmblocks; i++){
+		int slot = warmblocks[i] % MAPCACHE_SLOTS;
+		if(mapcachepointers[slot]){
+			putblock((union fs_block *)mapcachepointers[slot]);
 		}
-		// printf("past check\n");
+		mapcachepointers[slot] = warmpointers[i];
+		mapcacheblock[slot] = warmblocks[i];
+		mapcacheuses[slot] = 0;
+	}
+	nwarmblocks = 0;
+	warmready = 0;
+}
 
-		/* Computing Length of Bytes We are Going to Read */
-		int actlength;
-		// iNode size greater than what we want to read
-		if(length + offset > masterinode.size){
-			actlength = masterinode.size - offset;
-			// printf("actlength1: %d\n", masterinode.size-offset);
+/* Pointers of indirect block blocknum, read from the disk only on a miss. */
+int *cachedindirect(int blocknum){
+	if(warmready){
+		mapcacheinstall();
+	}
+	int slot = blocknum % MAPCACHE_SLOTS;
+	int hit = mapcacheblock[slot] == blocknum;
+	if(!hit){
+		if(!mapcachepointers[slot]){
+			mapcachepointers[slot] = getblock()->pointers;
 		}
-		else{
-			actlength = length; 
-			// printf("actlength2: %d\n", length);
+		readblock(blocknum, (char *)mapcachepointers[slot]);
+		mapcacheblock[slot] = blocknum;
+		mapcacheuses[slot] = 0;
+	}
+	else{
+		mapcacheuses[slot]++;
+		mapstats.hits++;
+		mapstats.windowhits++;
+	}
+	mapstats.lookups++;
+	if(mapstats.lookups % MAPCACHE_WINDOW == 0){
+		double rate = (double)mapstats.windowhits / MAPCACHE_WINDOW;
+		if(mapstats.firstwindow < 0){
+			mapstats.firstwindow = rate;
+		}
+		if(mapstats.warmafter == 0 && rate >= MAPCACHE_WARM){
+			mapstats.warmafter = mapstats.lookups;
 		}
-		int bytesleft = length;
+		mapstats.windowhits = 0;
+	}
+	return mapcachepointers[slot];
+}
 
-		// check if offset greater than size of master inode
-		int currblock = offset / DISK_BLOCK_SIZE; // current block
-		int curroffset = offset % DISK_BLOCK_SIZE; // offset within the given block
-		int currblocknum; // block number that is pointed to
+void mapcacheforget(int blocknum){
+	if(mapcacheblock[blocknum % MAPCACHE_SLOTS] == blocknum){
+		mapcacheblock[blocknum % MAPCACHE_SLOTS] = 0;
+	}
+}
 
-		int currindirectblock;
+/* Empties the cache, for a new mount. */
+void mapcacheclear(){
+	int i;
+	// a warm-up the last mount never used belongs to its image
+	for(i = 0; i < nwarmblocks; i++){
+		putblock((union fs_block *)warmpointers[i]);
+	}
+	nwarmblocks = 0;
+	warmready = 0;
+	memset(mapcacheblock, 0, sizeof(mapcacheblock));
+	memset(&mapstats, 0, sizeof(mapstats));
+	mapstats.firstwindow = -1;
+}
 
-		while(bytesleft > 0){
-			if(currblock > POINTERS_PER_INODE + POINTERS_PER_BLOCK){
-				break;
-			}/*
-			if(strlen(data) > length){
-				return 0;
-			}*/
-			if(currblock >= POINTERS_PER_INODE){
-				// printf("in if\n");
-				/* taking care of indirect block */
-				if(masterinode.indirect == 0){
-					currindirectblock = findfreeindirectblock(&masterinode);
-				}
-				else{
-					currindirectblock = masterinode.indirect;
-				}
-				if(currindirectblock == -1){
-					printf("No free indirect blocks\n");
-					return 0;
+/*
+	Warm-up list. The superblock carries the cache's hottest blocks from the last unmount, and
+	the next full mount reads them back before serving anything, a background mount once its
+	scan is done and a lazy one not at all, in block order and with the gaps
+	of up to WARM_GAP blocks between them read through, so a restart costs a few large reads
+	instead of a miss on every file's first access. The list is only a hint: a block handed out
+	again is dropped from the cache by allocblock, so an entry that went stale is never used.
+*/
+#define WARM_GAP 8
+
+/* Records the cache's blocks in the superblock, most used first. */
+void mapcachesave(){
+	int slots[MAPCACHE_SLOTS];
+	int nslots = 0, i, j;
+	for(i = 0; i < MAPCACHE_SLOTS; i++){
+		if(mapcacheblock[i] == 0){
+			continue;
+		}
+		for(j = nslots; j > 0 && mapcacheuses[slots[j-1]] < mapcacheuses[i]; j--){
+			slots[j] = slots[j-1];
+		}
+		slots[j] = i;
+		nslots++;
+	}
+	superblock.nwarm = nslots < WARM_MAX ? nslots : WARM_MAX;
+	for(i = 0; i < superblock.nwarm; i++){
+		superblock.warm[i] = mapcacheblock[slots[i]];
+	}
+}
+
+int compareblocks(const void *a, const void *b){
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+	Reads the superblock's warm-up list into warmpointers and sets warmready. A background
+	mount's scan thread calls it, so it leaves the cache itself alone.
+*/
+void mapcacheprefetch(){
+	int blocks[WARM_MAX];
+	int nblocks = 0, i, first, last, span;
+	struct timespec start, end;
+	char *staging;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < superblock.nwarm && i < WARM_MAX; i++){
+		if(superblock.warm[i] > superblock.ninodeblocks && superblock.warm[i] < superblock.nblocks){
+			blocks[nblocks++] = superblock.warm[i];
+		}
+	}
+	qsort(blocks, nblocks, sizeof(int), compareblocks);
+	staging = getcluster();
+	span = MAX_CLUSTER_SIZE / BLOCK_SIZE;
+	for(first = 0; first < nblocks; first = last){
+		for(last = first + 1; last < nblocks; last++){
+			if(blocks[last] - blocks[last-1] > WARM_GAP || blocks[last] - blocks[first] >= span){
+				break;
+			}
+		}
+		readblockrun(blocks[first], blocks[last-1] - blocks[first] + 1, staging);
+		mapstats.warmreads++;
+		for(i = first; i < last; i++){
+			warmpointers[i] = getblock()->pointers;
+			copyblock((char *)warmpointers[i], staging + (size_t)(blocks[i] - blocks[first])*BLOCK_SIZE);
+			warmblocks[i] = blocks[i];
+		}
+	}
+	putcluster(staging);
+	nwarmblocks = nblocks;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	mapstats.warmed = nblocks;
+	mapstats.warmms = (end.tv_sec - start.tv_sec)*1e3 + (end.tv_nsec - start.tv_nsec)/1e6;
+	warmready = 1;
+}
+
+/* Reads the superblock's warm-up list into the cache. */
+void mapcachewarm(){
+	mapcacheprefetch();
+	mapcacheinstall();
+}
+
+/* Prints the warm-up cost and how the hit rate came back. */
+void mapcachereport(){
+	printf("block map cache: %lld lookups, %.1f%% hits\n", mapstats.lookups, mapstats.lookups ? 100.0*mapstats.hits/mapstats.lookups : 0);
+	if(mapstats.warmed > 0){
+		printf("warm-up: %d blocks in %d reads, %.2f ms\n", mapstats.warmed, mapstats.warmreads, mapstats.warmms);
+	}
+	if(mapstats.firstwindow >= 0){
+		printf("first %d lookups: %.1f%% hits\n", MAPCACHE_WINDOW, 100*mapstats.firstwindow);
+	}
+	if(mapstats.warmafter > 0){
+		printf("hit rate reached %.0f%% after %lld lookups\n", 100*MAPCACHE_WARM, mapstats.warmafter);
+	}
+}
+
+/*
+	Fills map with the block pointers for logical blocks first .. first+count-1 of the inode.
+	The indirect block comes from the block map cache.
+	Negative entries are compressed cluster lengths, not block numbers.
+*/
+void readblockmap(struct fs_inode *inode, int first, int count, int *map){
+	const int *pointers = 0;
+	int i;
+	for(i = 0; i < count; i++){
+		int index = first + i;
+		if(index < POINTERS_PER_INODE){
+			map[i] = inode->direct[index];
+		}
+		else if(inode->indirect <= 0 || index >= BLOCKS_PER_FILE){
+			map[i] = 0;
+		}
+		else{
+			if(!pointers){
+				// the cache is shared, a read-only mount reads the mapping instead
+				pointers = mapped ? (const int *)mappedblock(inode->indirect) : cachedindirect(inode->indirect);
+			}
+			map[i] = pointers[index - POINTERS_PER_INODE];
+		}
+	}
+}
+
+/*
+	Dedup index: content hash to data block, chained through hashnext.
+	Only built for filesystems formatted with FS_FLAG_DEDUP.
+*/
+unsigned long long *blockhash;
+int *hashnext;
+int *hashbuckets;
+int nhashbuckets;
+
+static inline unsigned long long hashbytes(const char *data, int length){
+	unsigned long long hash = 14695981039346656037ULL;
+	unsigned long long word;
+	int i;
+	for(i = 0; i < length; i += sizeof(word)){
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+/* Each block size gets its own copy of the loop with a constant bound. */
+unsigned long long hashblock(const char *data){
+	switch(BLOCK_SIZE){
+		case 4096: return hashbytes(data, 4096);
+		case 8192: return hashbytes(data, 8192);
+		case 16384: return hashbytes(data, 16384);
+		case 32768: return hashbytes(data, 32768);
+		default: return hashbytes(data, 65536);
+	}
+}
+
+void dedupinit(int nblocks){
+	int i;
+	nhashbuckets = 1;
+	while(nhashbuckets < nblocks){
+		nhashbuckets *= 2;
+	}
+	blockhash = calloc(nblocks, sizeof(unsigned long long));
+	hashnext = calloc(nblocks, sizeof(int));
+	hashbuckets = malloc(nhashbuckets * sizeof(int));
+	for(i = 0; i < nhashbuckets; i++){
+		hashbuckets[i] = -1;
+	}
+}
+
+void dedupinsert(int blocknum, unsigned long long hash){
+	int bucket = hash & (nhashbuckets - 1);
+	blockhash[blocknum] = hash;
+	hashnext[blocknum] = hashbuckets[bucket];
+	hashbuckets[bucket] = blocknum;
+}
+
+void dedupremove(int blocknum){
+	int *link = &hashbuckets[blockhash[blocknum] & (nhashbuckets - 1)];
+	while(*link != -1){
+		if(*link == blocknum){
+			*link = hashnext[blocknum];
+			return;
+		}
+		link = &hashnext[*link];
+	}
+}
+
+/* Finds an indexed block holding exactly data, comparing contents to rule out hash collisions. Returns 0 if none. */
+int deduplookup(const char *data, unsigned long long hash){
+	int blocknum = hashbuckets[hash & (nhashbuckets - 1)];
+	while(blocknum != -1){
+		if(blockhash[blocknum] == hash){
+			union fs_block *candidate = getblock();
+			readblock(blocknum, candidate->data);
+			int same = !memcmp(candidate->data, data, BLOCK_SIZE);
+			putblock(candidate);
+			if(same){
+				return blocknum;
+			}
+		}
+		blocknum = hashnext[blocknum];
+	}
+	return 0;
+}
+
+/*
+	Blocks freed by fs_delete, fs_truncate and fs_snapshot_delete are punched out of the image,
+	so it stays sparse. Between discardbegin and discardend, freeblock collects blocks whose
+	last reference goes into runs, and each run becomes one disk_discard. Any allocation
+	flushes first, so a block is never punched after it is handed out again.
+*/
+#define DISCARD_RUNS 64
+
+struct discardrun {
+	int first;
+	int count;
+};
+
+struct discardrun discardruns[DISCARD_RUNS];
+int ndiscardruns = 0;
+int discarding = 0;
+
+void discardbegin(){
+	discarding = 1;
+}
+
+void discardflush(){
+	int i;
+	for(i = 0; i < ndiscardruns; i++){
+		// a host filesystem without hole punching just keeps the old contents
+		disk_discard(discardruns[i].first*sectorsperblock, discardruns[i].count*sectorsperblock);
+	}
+	ndiscardruns = 0;
+}
+
+/* Punches what was collected, once the blocks are no longer referenced on disk. */
+void discardend(){
+	discardflush();
+	discarding = 0;
+}
+
+/* Adds a freed block to the last run if it extends it either way, otherwise starts a new one. */
+void discardblock(int blocknum){
+	struct discardrun *run = ndiscardruns > 0 ? &discardruns[ndiscardruns-1] : 0;
+	if(run && blocknum == run->first + run->count){
+		run->count++;
+		return;
+	}
+	if(run && blocknum == run->first - 1){
+		run->first--;
+		run->count++;
+		return;
+	}
+	if(ndiscardruns == DISCARD_RUNS){
+		discardflush();
+	}
+	discardruns[ndiscardruns].first = blocknum;
+	discardruns[ndiscardruns].count = 1;
+	ndiscardruns++;
+}
+
+/*
+	Allocation policies. A policy picks a free block given a goal, the block the caller would like,
+	0 for no preference, and whether the block is file data. Metadata never has a goal.
+	lowestfree is the lowest block that might be free, so no policy rescans the full part of the
+	disk, and freeblock lowers it again.
+*/
+struct allocpolicy {
+	const char *name;
+	int (*allocate)(int goal, int data); // a free block, not yet marked, or -1
+};
+
+int lowestfree = 1;
+
+/* The lowest free block, the original behaviour. */
+int allocfirstfit(int goal, int data){
+	int i;
+	for(i = lowestfree; i < superblock.nblocks; i++){
+		if(freeblockbitmap[i] == 0){
+			lowestfree = i;
+			return i;
+		}
+	}
+	lowestfree = superblock.nblocks;
+	return -1;
+}
+
+/* The goal if it is free, else the nearest free block after it, wrapping round to the lowest. */
+int allocgoal(int goal, int data){
+	int i;
+	if(goal <= 0 || goal >= superblock.nblocks){
+		return allocfirstfit(goal, data);
+	}
+	for(i = goal; i < superblock.nblocks; i++){
+		if(freeblockbitmap[i] == 0){
+			return i;
+		}
+	}
+	return allocfirstfit(goal, data);
+}
+
+/*
+	Reservation windows. A file writing data gets a window of blocks after the one it took, and
+	other allocations step round the part it has not used yet, so writers taking turns each stay
+	in a run of their own. A window belongs to whoever asks for its next block, which is where a
+	file's goal points while it writes sequentially. Each time a window runs out it is renewed
+	twice as big, in place if the blocks after it are free. Windows only live in memory and hold
+	no blocks in freeblockbitmap, when nothing else is free their blocks are handed out too.
+*/
+#define RESERVE_WINDOWS 32
+#define RESERVE_MIN     16 // blocks in a file's first window
+#define RESERVE_MAX     1024
+#define RESERVE_SEARCH  65536 // blocks looked at for an unreserved one before taking the lowest free
+
+struct reservewindow {
+	int next; // next block to hand out, 0 for an unused slot
+	int end; // one past the last reserved block
+	int size; // blocks asked for when the window was last renewed
+	unsigned lastuse;
+};
+
+struct reservewindow windows[RESERVE_WINDOWS];
+unsigned windowclock = 0;
+
+/* Returns one if block b is held back for some window. */
+int isreserved(int b){
+	int i;
+	for(i = 0; i < RESERVE_WINDOWS; i++){
+		if(windows[i].next > 0 && b >= windows[i].next && b < windows[i].end){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int isfreeunreserved(int b){
+	return freeblockbitmap[b] == 0 && !isreserved(b);
+}
+
+/*
+	The window holding block b, or else the nearest one after it, as its first reserved block
+	with its end in *end. Windows never overlap, so a scan can step over a whole one at a time.
+	Returns superblock.nblocks if no window lies at or after b.
+*/
+int windowafter(int b, int *end){
+	int i, first = superblock.nblocks;
+	*end = superblock.nblocks;
+	for(i = 0; i < RESERVE_WINDOWS; i++){
+		if(windows[i].next > 0 && windows[i].next < windows[i].end && windows[i].end > b && windows[i].next < first){
+			first = windows[i].next;
+			*end = windows[i].end;
+		}
+	}
+	return first;
+}
+
+/*
+	First free unreserved block at or after start, wrapping round, that begins a run of length
+	free blocks. Gives up with -1 after looking at limit blocks.
+*/
+int findunreserved(int start, int length, int limit){
+	int i, run = 0, pass, wfirst, wend;
+	if(start < lowestfree || start >= superblock.nblocks){
+		start = lowestfree;
+	}
+	for(pass = 0; pass < 2; pass++){
+		int from = pass == 0 ? start : lowestfree;
+		int to = pass == 0 ? superblock.nblocks : start;
+		run = 0;
+		wfirst = windowafter(from, &wend);
+		for(i = from; i < to && limit > 0; i++, limit--){
+			if(i >= wfirst){
+				// skip the rest of the window in one step
+				limit -= wend - i - 1;
+				i = wend - 1;
+				run = 0;
+				wfirst = windowafter(wend, &wend);
+				continue;
+			}
+			run = freeblockbitmap[i] == 0 ? run + 1 : 0;
+			if(run == length){
+				return i - length + 1;
+			}
+		}
+	}
+	return -1;
+}
+
+/* Points window w at block b, reserving up to size blocks from it, as many as are free in a row. */
+void openwindow(struct reservewindow *w, int b, int size){
+	int wend;
+	w->next = 0;
+	w->end = 0;
+	w->size = size;
+	w->lastuse = ++windowclock;
+	int limit = windowafter(b + 1, &wend);
+	if(limit > b + size){
+		limit = b + size;
+	}
+	int end = b + 1;
+	while(end < limit && freeblockbitmap[end] == 0){
+		end++;
+	}
+	w->next = b + 1;
+	w->end = end;
+}
+
+int allocreserve(int goal, int data){
+	struct reservewindow *w = 0;
+	int b, i, size = RESERVE_MIN;
+
+	if(!data){
+		b = findunreserved(lowestfree, 1, RESERVE_SEARCH);
+		return b != -1 ? b : allocfirstfit(goal, data);
+	}
+	if(goal > 0){
+		for(i = 0; i < RESERVE_WINDOWS; i++){
+			if(windows[i].next == goal){
+				w = &windows[i];
+				break;
+			}
+		}
+	}
+	if(w && goal < w->end && freeblockbitmap[goal] == 0){
+		w->next++;
+		w->lastuse = ++windowclock;
+		return goal;
+	}
+	if(w){
+		// run out, or its blocks were taken after all: renew it bigger
+		size = w->size*2 > RESERVE_MAX ? RESERVE_MAX : w->size*2;
+		w->next = w->end = 0;
+	}
+	else{
+		// a new writer takes the least recently used slot
+		w = &windows[0];
+		for(i = 1; i < RESERVE_WINDOWS; i++){
+			if(windows[i].lastuse < w->lastuse){
+				w = &windows[i];
+			}
+		}
+	}
+
+	if(goal > 0 && goal < superblock.nblocks && isfreeunreserved(goal)){
+		b = goal;
+	}
+	else{
+		b = findunreserved(goal, RESERVE_MIN, RESERVE_SEARCH);
+		if(b == -1){
+			b = findunreserved(goal, 1, RESERVE_SEARCH);
+		}
+	}
+	if(b == -1){
+		w->next = w->end = 0;
+		return allocfirstfit(goal, data);
+	}
+	openwindow(w, b, size);
+	return b;
+}
+
+struct allocpolicy allocpolicies[] = {
+	{"firstfit", allocfirstfit},
+	{"goal", allocgoal},
+	{"reserve", allocreserve},
+};
+
+struct allocpolicy *allocpolicy = &allocpolicies[FS_ALLOC_RESERVE];
+
+/* Frees the blocks of one held run and empties its slot. They were never mapped or written. */
+int freehold(struct appendhold *h){
+	int released = 0;
+	for(; h->count > 0; h->count--, h->next++){
+		freeblockbitmap[h->next] = 0;
+		if(h->next < lowestfree){
+			lowestfree = h->next;
+		}
+		released++;
+	}
+	h->inumber = 0;
+	return released;
+}
+
+/* Frees the blocks held ahead of the tails of appended files. */
+int releaseheld(){
+	int i, released = 0;
+	for(i = 0; i < APPEND_HELD; i++){
+		released += freehold(&appending.held[i]);
+	}
+	return released;
+}
+
+/* Frees the blocks held ahead of the tail of inode inumber, once its tail moves some other way. */
+void releasehold(int inumber){
+	int i;
+	for(i = 0; i < APPEND_HELD; i++){
+		if(appending.held[i].inumber == inumber){
+			freehold(&appending.held[i]);
+		}
+	}
+}
+
+/* Takes a free block through the current policy and marks it in use. Returns -1 if the disk is full. */
+int allocblock(int goal, int data){
+	int b;
+	// a block waiting to be punched must be gone before it can hold new data
+	if(ndiscardruns > 0){
+		discardflush();
+	}
+	b = allocpolicy->allocate(goal, data);
+	// blocks held for appends give way before the disk counts as full
+	if(b == -1 && releaseheld() > 0){
+		b = allocpolicy->allocate(goal, data);
+	}
+	if(b != -1){
+		freeblockbitmap[b] = 1;
+		mapcacheforget(b);
+		while(lowestfree < superblock.nblocks && freeblockbitmap[lowestfree] != 0){
+			lowestfree++;
+		}
+	}
+	return b;
+}
+
+/* Metadata: indirect blocks, snapshot maps and inode block copies. */
+int findfreeblock(){
+	return allocblock(0, 0);
+}
+
+/* The block after the one holding the nearest allocated logical block before index, 0 if there is none. */
+int blockgoal(struct fs_inode *inode, int index){
+	int map[2*CLUSTER_BLOCKS];
+	int first = index > 2*CLUSTER_BLOCKS ? index - 2*CLUSTER_BLOCKS : 0;
+	int i;
+	readblockmap(inode, first, index - first, map);
+	for(i = index - first - 1; i >= 0; i--){
+		if(map[i] > 0){
+			return map[i] + 1;
+		}
+	}
+	return 0;
+}
+
+/* Forgets every window and hint, for a new mount. */
+void allocreset(){
+	memset(windows, 0, sizeof(windows));
+	windowclock = 0;
+	lowestfree = 1;
+}
+
+/*
+	Chooses the policy later allocations use, one of FS_ALLOC_*. Returns one on success,
+	zero if there is no such policy.
+*/
+int fs_alloc_policy( int policy )
+{
+	if(policy < 0 || policy >= (int)(sizeof(allocpolicies) / sizeof(allocpolicies[0]))){
+		printf("Error: no allocation policy %d\n", policy);
+		return 0;
+	}
+	allocpolicy = &allocpolicies[policy];
+	memset(windows, 0, sizeof(windows));
+	return 1;
+}
+
+/*
+	Drops one reference to a block, ignoring anything that is not a block number.
+	The block is free once nothing refers to it.
+*/
+void freeblock(int blocknum){
+	if(blocknum > 0 && blocknum < superblock.nblocks && freeblockbitmap[blocknum] > 0){
+		freeblockbitmap[blocknum]--;
+		if(freeblockbitmap[blocknum] == 0){
+			mapcacheforget(blocknum);
+			if(blocknum < lowestfree){
+				lowestfree = blocknum;
+			}
+			if(superblock.flags & FS_FLAG_DEDUP){
+				dedupremove(blocknum);
+			}
+			if(discarding){
+				discardblock(blocknum);
+			}
+		}
+	}
+}
+
+/* Writes the appended inode back and ends the stream, keeping the blocks held for the next appends. */
+void appendend(){
+	if(appending.inumber != 0){
+		saveinode(appending.inumber, &appending.inode);
+	}
+}
+
+/* Ends the stream and frees every block held ahead of a tail. */
+void appendflush(){
+	appendend();
+	releaseheld();
+}
+
+/* Counts a reference to a data block found while mounting, indexing its contents the first time in dedup mode. */
+void mountdatablock(int blocknum){
+	if(freeblockbitmap[blocknum]++ == 0 && (superblock.flags & FS_FLAG_DEDUP)){
+		union fs_block *block = getblock();
+		readblock(blocknum, block->data);
+		dedupinsert(blocknum, hashblock(block->data));
+		putblock(block);
+	}
+}
+
+/* Counts a reference to an indirect block, and the first time its data blocks. */
+void mountindirect(int blocknum){
+	if(freeblockbitmap[blocknum]++ == 0){
+		union fs_block *indirectblock = getblock();
+		readblock(blocknum, indirectblock->data);
+		int currpointer;
+		for(currpointer = 0; currpointer < POINTERS_PER_BLOCK; currpointer++){
+			if(indirectblock->pointers[currpointer] <= 0){
+				continue;
+			}
+			mountdatablock(indirectblock->pointers[currpointer]);
+		}
+		putblock(indirectblock);
+	}
+}
+
+/* Counts a reference to an inode block, and the first time every block its inodes use. */
+void mountinodeblock(int blocknum, int first){
+	if(freeblockbitmap[blocknum]++ == 0){
+		union fs_block *tempBlock = getblock();
+		readblock(blocknum, tempBlock->data);
+		int currinode;
+		for(currinode = first; currinode < INODES_PER_BLOCK; currinode++){
+			// check if inode is actually created
+			if(inodeused(&tempBlock->inode[currinode])){
+				int currinodeblock;
+				for(currinodeblock = 0; currinodeblock < POINTERS_PER_INODE; currinodeblock++){
+					// not a data block: unused or a compressed cluster length
+					if(tempBlock->inode[currinode].direct[currinodeblock] <= 0){
+						continue;
+					}
+					mountdatablock(tempBlock->inode[currinode].direct[currinodeblock]);
+				}
+				if(tempBlock->inode[currinode].indirect > 0){
+					mountindirect(tempBlock->inode[currinode].indirect);
+				}
+			}
+		}
+		putblock(tempBlock);
+	}
+}
+
+/*
+	Builds the reference counts by walking the live inode table and every snapshot's own
+	inode blocks, the ones a snapshot still shares with the live table are already counted.
+*/
+void scanrefcounts(){
+	int currblock, currsnap;
+	// go through each inode block and check every inode 1 if in use 0 otherwise
+	// if data block is 0 then it is not being used, anything else and it is being used
+	// only inode 0 of the first block is reserved
+	for(currblock = 1; currblock <= superblock.ninodeblocks; currblock++){
+		mountinodeblock(currblock, currblock == 1);
+	}
+	for(currsnap = 0; currsnap < FS_SNAPSHOT_MAX; currsnap++){
+		if(superblock.snapshots[currsnap].mapblock == 0){
+			continue;
+		}
+		freeblockbitmap[superblock.snapshots[currsnap].mapblock] = 1;
+		for(currblock = 0; currblock < snapmapblocks(superblock.ninodeblocks); currblock++){
+			if(snapindexes[currsnap][currblock] != 0){
+				freeblockbitmap[snapindexes[currsnap][currblock]] = 1;
+			}
+		}
+		for(currblock = 1; currblock <= superblock.ninodeblocks; currblock++){
+			if(snapmaps[currsnap][currblock-1] != 0){
+				mountinodeblock(snapmaps[currsnap][currblock-1], currblock == 1);
+			}
+		}
+	}
+}
+
+/*
+	State of the reference counts after a lazy mount. Reads never look at them, so only
+	calls that allocate, free or share blocks wait for them through needrefcounts.
+*/
+#define REFCOUNTS_READY   0
+#define REFCOUNTS_PENDING 1 // built by the first call that needs them
+#define REFCOUNTS_SCANNING 2 // being built by scanthread
+int refcountstate = REFCOUNTS_READY;
+pthread_t scanthread;
+int scanwarm = 0; // the scan thread prefetches the warm-up list once the counts are built
+
+void *runscan(void *arg){
+	scanrefcounts();
+	if(scanwarm){
+		mapcacheprefetch();
+	}
+	return 0;
+}
+
+/* Makes sure the reference counts are complete, building them now or waiting for the background scan. */
+void needrefcounts(){
+	if(refcountstate == REFCOUNTS_SCANNING){
+		pthread_join(scanthread, 0);
+		// before anything freed can leave a prefetched block stale
+		if(warmready){
+			mapcacheinstall();
+		}
+	}
+	else if(refcountstate == REFCOUNTS_PENDING){
+		scanrefcounts();
+	}
+	refcountstate = REFCOUNTS_READY;
+}
+
+/*
+	Snapshot sharing. A reference count is the number of pointers to a block from distinct
+	inode, indirect or map blocks, so a shared indirect block holds one reference to each of
+	its data blocks however many files point at it. A block is copied before it is changed
+	while its count is above one, and the copy takes a reference to everything it points at.
+*/
+
+/* Drops a reference to an indirect block, and to the blocks it points at once nothing else needs it. */
+void dropindirect(int blocknum){
+	union fs_block *block;
+	int i;
+	if(blocknum <= 0){
+		return;
+	}
+	if(freeblockbitmap[blocknum] == 1){
+		block = getblock();
+		readblock(blocknum, block->data);
+		for(i = 0; i < POINTERS_PER_BLOCK; i++){
+			freeblock(block->pointers[i]);
+		}
+		putblock(block);
+	}
+	freeblock(blocknum);
+}
+
+/* Drops a reference to a snapshot's private inode block, releasing its files once nothing else needs it. */
+void dropinodeblock(int blocknum, int first){
+	union fs_block *block;
+	int i, j;
+	if(freeblockbitmap[blocknum] == 1){
+		block = getblock();
+		readblock(blocknum, block->data);
+		for(i = first; i < INODES_PER_BLOCK; i++){
+			if(!inodeused(&block->inode[i])){
+				continue;
+			}
+			for(j = 0; j < POINTERS_PER_INODE; j++){
+				freeblock(block->inode[i].direct[j]);
+			}
+			dropindirect(block->inode[i].indirect);
+		}
+		putblock(block);
+	}
+	freeblock(blocknum);
+}
+
+/* Takes a reference to every block the inodes of an inode block point at. */
+void shareinodeblock(union fs_block *block){
+	int i, j;
+	for(i = 0; i < INODES_PER_BLOCK; i++){
+		if(!inodeused(&block->inode[i])){
+			continue;
+		}
+		for(j = 0; j < POINTERS_PER_INODE; j++){
+			if(block->inode[i].direct[j] > 0){
+				freeblockbitmap[block->inode[i].direct[j]]++;
+			}
+		}
+		if(block->inode[i].indirect > 0){
+			freeblockbitmap[block->inode[i].indirect]++;
+		}
+	}
+}
+
+/* Writes the in-memory superblock, with its snapshot table, back to block 0. */
+void savesuperblock(){
+	union fs_block *block = getblock();
+	memset(block->data, 0, DISK_BLOCK_SIZE);
+	mapcachesave();
+	block->super = superblock;
+	disk_write(0, block->data);
+	putblock(block);
+}
+
+/*
+	Makes sure the map block for entry index of snapshot slot exists on disk, allocating it and
+	the block listing the map blocks the first time. Returns one on success, zero if the disk is full.
+*/
+int holdsnapmapentry(int slot, int index){
+	int k = index / POINTERS_PER_BLOCK;
+	int indexblock = superblock.snapshots[slot].mapblock;
+	int mapblock;
+	if(snapindexes[slot][k] != 0){
+		return 1;
+	}
+	if(indexblock == 0){
+		indexblock = findfreeblock();
+		if(indexblock == -1){
+			return 0;
+		}
+	}
+	mapblock = findfreeblock();
+	if(mapblock == -1){
+		if(superblock.snapshots[slot].mapblock == 0){
+			freeblock(indexblock);
+		}
+		return 0;
+	}
+	// each block is written before anything points at it
+	writeblock(mapblock, (char *)(snapmaps[slot] + k*POINTERS_PER_BLOCK));
+	snapindexes[slot][k] = mapblock;
+	writeblock(indexblock, (char *)snapindexes[slot]);
+	if(superblock.snapshots[slot].mapblock == 0){
+		superblock.snapshots[slot].mapblock = indexblock;
+		savesuperblock();
+	}
+	return 1;
+}
+
+/* Writes back the map block holding entry index of snapshot slot, which holdsnapmapentry made sure of. */
+void savesnapmapentry(int slot, int index){
+	int k = index / POINTERS_PER_BLOCK;
+	writeblock(snapindexes[slot][k], (char *)(snapmaps[slot] + k*POINTERS_PER_BLOCK));
+}
+
+/*
+	Gives every snapshot still sharing live inode block blocknum its own copy, so the live one
+	can change. Snapshots taken while the block was unchanged share the one copy.
+	Returns one on success, zero if the disk is full.
+*/
+int unshareinodeblock(int blocknum){
+	union fs_block *block;
+	int copy = 0;
+	int i;
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		if(!snapshotused(&superblock.snapshots[i]) || snapmaps[i][blocknum-1] != 0){
+			continue;
+		}
+		if(!holdsnapmapentry(i, blocknum-1)){
+			printf("Error: No Valid Block Available\n");
+			return 0;
+		}
+		if(copy == 0){
+			copy = findfreeblock();
+			if(copy == -1){
+				printf("Error: No Valid Block Available\n");
+				return 0;
+			}
+			block = getblock();
+			readblock(blocknum, block->data);
+			writeblock(copy, block->data);
+			shareinodeblock(block);
+			putblock(block);
+		}
+		else{
+			freeblockbitmap[copy]++;
+		}
+		snapmaps[i][blocknum-1] = copy;
+		savesnapmapentry(i, blocknum-1);
+	}
+	return 1;
+}
+
+/*
+	Refuses changes to a read-only mount, then makes sure the reference counts are built
+	and no snapshot shares the inode's block.
+*/
+int writableinode(int inumber){
+	if(readonlymount()){
+		return 0;
+	}
+	needrefcounts();
+	return unshareinodeblock(inumber/INODES_PER_BLOCK + 1);
+}
+
+/*
+	Copies the inode's indirect block if a snapshot still shares it, so its pointers can change.
+	The caller saves the inode. Returns one on success, zero if the disk is full.
+*/
+int ownindirect(struct fs_inode *inode){
+	union fs_block *block;
+	int copy, i;
+	if(inode->indirect <= 0 || freeblockbitmap[inode->indirect] <= 1){
+		return 1;
+	}
+	copy = findfreeblock();
+	if(copy == -1){
+		printf("Error: No Valid Block Available\n");
+		return 0;
+	}
+	block = getblock();
+	readblock(inode->indirect, block->data);
+	writeblock(copy, block->data);
+	for(i = 0; i < POINTERS_PER_BLOCK; i++){
+		if(block->pointers[i] > 0){
+			freeblockbitmap[block->pointers[i]]++;
+		}
+	}
+	putblock(block);
+	freeblock(inode->indirect);
+	inode->indirect = copy;
+	return 1;
+}
+
+/* Returns one if the first length bytes of data are all zero. */
+int iszero(const char *data, int length){
+	int i;
+	for(i = 0; i < length; i++){
+		if(data[i] != 0){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline int iszerowords(const char *data, int length){
+	unsigned long long word, any = 0;
+	int i;
+	for(i = 0; i < length; i += sizeof(word)){
+		memcpy(&word, data + i, sizeof(word));
+		any |= word;
+	}
+	return any == 0;
+}
+
+/* iszero for exactly one block, specialized per block size like hashblock. */
+int iszeroblock(const char *data){
+	switch(BLOCK_SIZE){
+		case 4096: return iszerowords(data, 4096);
+		case 8192: return iszerowords(data, 8192);
+		case 16384: return iszerowords(data, 16384);
+		case 32768: return iszerowords(data, 32768);
+		default: return iszerowords(data, 65536);
+	}
+}
+
+/* Number of logical blocks in a compression cluster, the last one of a file may be short. */
+int clusterslots(int cluster){
+	int slots = BLOCKS_PER_FILE - cluster*CLUSTER_BLOCKS;
+	if(slots > CLUSTER_BLOCKS){
+		return CLUSTER_BLOCKS;
+	}
+	return slots > 0 ? slots : 0;
+}
+
+/*
+	Creates a new filesystem on the disk, destroying any data already present. 
+	Sets aside ten percent of the blocks for inodes unless the options ask otherwise, clears the inode table, and writes the superblock. 
+	Returns one on success, zero otherwise. 
+	Note that formatting a filesystem does not cause it to be mounted. 
+	Also, an attempt to format an already-mounted disk should do nothing and return failure.
+*/
+int checkinode(int inumber){
+	struct fs_inode inode;
+	if(inumber <= 0 || inumber >= superblock.ninodes){
+		return 0;
+	}
+	loadinode(inumber, &inode);
+	return inodeused(&inode);
+}
+
+#define CLEAR_CHUNK (1<<20) // bytes of zeros written per transfer when clearing blocks
+
+/*
+	Zeroes count blocks starting at first. With discard they are punched out of the image
+	instead, falling back to writing when the image cannot punch holes. Zeros are written
+	in CLEAR_CHUNK transfers, which also go to every striped member at once.
+	Returns one on success, zero if memory runs out.
+*/
+int clearblocks(int first, int count, int discard){
+	int nsectors = count * sectorsperblock;
+	int sector = first * sectorsperblock;
+	int chunk = CLEAR_CHUNK / DISK_BLOCK_SIZE;
+	char *zeros;
+
+	if(discard && disk_discard(sector, nsectors)){
+		return 1;
+	}
+	zeros = calloc(chunk, DISK_BLOCK_SIZE);
+	if(!zeros){
+		printf("Error: out of memory\n");
+		return 0;
+	}
+	while(nsectors > 0){
+		int length = nsectors < chunk ? nsectors : chunk;
+		disk_write_blocks(sector, length, zeros);
+		sector += length;
+		nsectors -= length;
+	}
+	free(zeros);
+	return 1;
+}
+
+int fs_format()
+{
+	return fs_format_with(0);
+}
+
+int fs_format_with( const struct fs_format_options *opts )
+{
+	if(opts && (opts->flags & FS_FORMAT_COMPRESS) && (opts->flags & FS_FORMAT_DEDUP)){
+		printf("Error: compress and dedup cannot be combined\n");
+		return 0;
+	}
+	if(ismounted == 0){
+		int size = opts ? opts->blocksize : 0;
+		if(!setgeometry(size)){
+			printf("Error: block size must be a power of two from %d to %d bytes\n", DISK_BLOCK_SIZE, FS_MAX_BLOCK_SIZE);
+			return 0;
+		}
+
+		int numBlocks = disk_size() / sectorsperblock;
+		int percentage = numBlocks/10; 
+
+		/* an explicit inode count wins over a ratio, and either over the ten percent default */
+		if(opts && opts->ninodes > 0){
+			// plus the reserved inode 0
+			percentage = (opts->ninodes + INODES_PER_BLOCK) / INODES_PER_BLOCK;
+		}
+		else if(opts && opts->inoderatio > 0){
+			long long ninodes = (long long)numBlocks * BLOCK_SIZE / opts->inoderatio;
+			percentage = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+		}
+		if(percentage < 1 || percentage >= numBlocks - 1){
+			printf("Error: %d inode blocks do not fit a disk of %d blocks\n", percentage, numBlocks);
+			return 0;
+		}
+
+		// clear the inode table, destroying the old files whatever block size they had
+		if(!clearblocks(1, percentage, opts && (opts->flags & FS_FORMAT_DISCARD))){
+			return 0;
+		}
+		// the data blocks are garbage until written, so dropping them is only to give the space back
+		if(opts && (opts->flags & FS_FORMAT_DISCARD)){
+			disk_discard((percentage + 1) * sectorsperblock, (numBlocks - percentage - 1) * sectorsperblock);
+		}
+
+		// only the superblock part needs clearing, the disk block written past it is not read
+		union fs_block *newBlock = getblock();
+		memset(newBlock->data, 0, DISK_BLOCK_SIZE);
+		newBlock->super.magic = FS_MAGIC;
+		newBlock->super.nblocks = numBlocks;
+		newBlock->super.ninodeblocks = percentage;
+		newBlock->super.ninodes = percentage*INODES_PER_BLOCK;
+		newBlock->super.flags = 0;
+		newBlock->super.blocksize = BLOCK_SIZE;
+		if(opts && (opts->flags & FS_FORMAT_COMPRESS)){
+			newBlock->super.flags |= FS_FLAG_COMPRESS;
+		}
+		if(opts && (opts->flags & FS_FORMAT_DEDUP)){
+			newBlock->super.flags |= FS_FLAG_DEDUP;
+		}
+
+		// write the superblock to disk, will be the initial block
+		disk_write(0, newBlock->data);
+		putblock(newBlock);
+		return 1;
+	}
+	else if(ismounted == 1){
+		printf("Disk already mounted\n");
+	}
+	return 0;
+}
+
+/*
+	Debug output is gathered in a buffer and written out DEBUG_CHUNK bytes at a time,
+	so a big image does not cost a stdio call for every pointer.
+*/
+#define DEBUG_CHUNK 65536
+char debugbuffer[2*DEBUG_CHUNK];
+int debuglength = 0;
+
+void debugflush(){
+	fwrite(debugbuffer, 1, debuglength, stdout);
+	debuglength = 0;
+}
+
+void debugprint(const char *format, ...){
+	va_list args;
+	int n;
+	va_start(args, format);
+	n = vsnprintf(debugbuffer + debuglength, sizeof(debugbuffer) - debuglength, format, args);
+	va_end(args);
+	if(n >= (int)sizeof(debugbuffer) - debuglength){
+		// no room left, start the line over in an empty buffer
+		debugflush();
+		va_start(args, format);
+		n = vsnprintf(debugbuffer, sizeof(debugbuffer), format, args);
+		va_end(args);
+		if(n >= (int)sizeof(debugbuffer)){
+			n = sizeof(debugbuffer) - 1;
+		}
+	}
+	debuglength += n;
+	if(debuglength >= DEBUG_CHUNK){
+		debugflush();
+	}
+}
+
+// totals over the inodes fs_debug looked at
+struct debugstats {
+	int files;
+	long long logicalbytes;
+	long long datablocks;
+	long long indirectblocks;
+	long long holes;
+	long long extents; // runs of logically and physically consecutive blocks
+	int fragmentedfiles; // files in more than one extent
+	int compressedclusters;
+};
+
+/* Prints count block pointers, as a JSON array or a space separated list. */
+void debugpointers(const int *pointers, int count, int json){
+	int i, first = 1;
+	debugprint(json ? "[" : "");
+	for(i = 0; i < count; i++){
+		if(pointers[i] <= 0){
+			continue;
+		}
+		debugprint(json ? (first ? "%d" : ",%d") : "%d ", pointers[i]);
+		first = 0;
+	}
+	debugprint(json ? "]" : "\n");
+}
+
+/* Reports inode inumber and adds it to the totals. */
+void debuginode(int inumber, struct fs_inode *inode, int flags, int nfiles, struct debugstats *stats){
+	int *map = getmap();
+	int json = flags & FS_DEBUG_JSON;
+	int nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int extents = 0, previous = 0, i;
+
+	if(nblocks > BLOCKS_PER_FILE){
+		nblocks = BLOCKS_PER_FILE;
+	}
+	readblockmap(inode, 0, BLOCKS_PER_FILE, map);
+	for(i = 0; i < BLOCKS_PER_FILE; i++){
+		if(map[i] < 0){
+			stats->compressedclusters++;
+		}
+		else if(map[i] > 0){
+			stats->datablocks++;
+			if(map[i] != previous + 1 || previous <= 0){
+				extents++;
+			}
+		}
+		else if(i < nblocks && !(superblock.flags & FS_FLAG_COMPRESS)){
+			stats->holes++;
+		}
+		previous = map[i];
+	}
+	stats->files++;
+	stats->logicalbytes += inode->size;
+	stats->extents += extents;
+	stats->fragmentedfiles += extents > 1;
+	stats->indirectblocks += inode->indirect > 0;
+
+	if(flags & FS_DEBUG_SUMMARY){
+		// totals only
+	}
+	else if(json){
+		debugprint("%s\n    {\"inode\": %d, \"size\": %d, \"extents\": %d, \"direct\": ", nfiles ? "," : "", inumber, inode->size, extents);
+		debugpointers(inode->direct, POINTERS_PER_INODE, 1);
+		debugprint(", \"indirect\": %d, \"indirect_blocks\": ", inode->indirect > 0 ? inode->indirect : 0);
+		debugpointers(map + POINTERS_PER_INODE, inode->indirect > 0 ? POINTERS_PER_BLOCK : 0, 1);
+		debugprint("}");
+	}
+	else{
+		debugprint("inode: %d\n", inumber);
+		debugprint("\tsize: %d bytes\n", inode->size);
+		debugprint("\tdirect blocks: ");
+		debugpointers(inode->direct, POINTERS_PER_INODE, 0);
+		if(inode->indirect > 0){
+			debugprint("\tindirect block: %d\n", inode->indirect);
+			debugprint("\tindirect data blocks: ");
+			debugpointers(map + POINTERS_PER_INODE, POINTERS_PER_BLOCK, 0);
+		}
+		debugprint("\textents: %d\n", extents);
+	}
+	putmap(map);
+}
+
+void fs_debug()
+{
+	fs_debug_with(0);
+}
+
+/*
+	Reports the superblock, then every inode or only opts->inumber, then totals. Only the
+	inode table is read, plus the indirect blocks of the files reported. Output is text,
+	or one JSON object with FS_DEBUG_JSON, and FS_DEBUG_SUMMARY leaves out the inodes.
+*/
+void fs_debug_with( const struct fs_debug_options *opts )
+{
+	union fs_block *block = getblock();
+	struct fs_superblock super;
+	struct debugstats stats;
+	int flags = opts ? opts->flags : 0;
+	int only = opts ? opts->inumber : 0;
+	int json = flags & FS_DEBUG_JSON;
+
+	// the inode blocks are read whole, so a pending append goes out first
+	appendflush();
+	memset(&stats, 0, sizeof(stats));
+	disk_read(0,block->data);
+	super = block->super;
+
+	if(super.magic == FS_MAGIC && !ismounted && !setgeometry(super.blocksize)){
+		printf("unsupported block size %d\n", super.blocksize);
+		putblock(block);
+		return;
+	}
+	if(json){
+		debugprint("{\n  \"superblock\": {\"valid\": %s, \"blocks\": %d, \"block_size\": %d, \"inode_blocks\": %d, \"inodes\": %d, \"flags\": %d}",
+			super.magic == FS_MAGIC ? "true" : "false", super.nblocks, super.magic == FS_MAGIC ? BLOCK_SIZE : DISK_BLOCK_SIZE,
+			super.ninodeblocks, super.ninodes, super.flags);
+	}
+	else{
+		debugprint("superblock:\n");
+		debugprint("\t%d blocks of %d bytes\n",super.nblocks,super.magic == FS_MAGIC ? BLOCK_SIZE : DISK_BLOCK_SIZE);
+		debugprint("\t%d inode blocks\n",super.ninodeblocks);
+		debugprint("\t%d inodes\n",super.ninodes);
+	}
+
+	if(super.magic == FS_MAGIC){
+		// when mounted the geometry and snapshot maps are the mounted ones
+		if(!ismounted){
+			superblock = super;
+		}
+		int firstblock = 1, lastblock = super.ninodeblocks;
+		if(only > 0){
+			if(only >= super.ninodes){
+				only = super.ninodes;
+			}
+			firstblock = lastblock = only/INODES_PER_BLOCK + 1;
+		}
+		if(json && !(flags & FS_DEBUG_SUMMARY)){
+			debugprint(",\n  \"inodes\": [");
+		}
+
+		int currblock;
+		for(currblock = firstblock; currblock <= lastblock && currblock <= super.ninodeblocks; currblock++){
+			if(ismounted && mountedsnapshot >= 0){
+				readblock(snapinodeblock(snapmaps[mountedsnapshot], currblock-1), block->data);
+			}
+			else{
+				readblock(currblock, block->data);
+			}
+			int currinode;
+			// only inode 0 of the first block is reserved
+			for(currinode = (currblock == 1); currinode < INODES_PER_BLOCK; currinode++){
+				int inumber = (currblock-1)*INODES_PER_BLOCK + currinode;
+				// check if the inode is actually created
+				if(!inodeused(&block->inode[currinode]) || (only > 0 && inumber != only)){
+					continue;
+				}
+				debuginode(inumber, &block->inode[currinode], flags, stats.files, &stats);
+			}
+		}
+
+		long long usedblocks = -1;
+		if(ismounted){
+			int i;
+			needrefcounts();
+			usedblocks = 0;
+			for(i = 1; i < superblock.nblocks; i++){
+				usedblocks += freeblockbitmap[i] > 0;
+			}
+		}
+		double extentsperfile = stats.files ? (double)stats.extents / stats.files : 0;
+
+		if(json){
+			if(!(flags & FS_DEBUG_SUMMARY)){
+				debugprint("%s]", stats.files ? "\n  " : "");
+			}
+			debugprint(",\n  \"summary\": {\"files\": %d, \"bytes\": %lld, \"data_blocks\": %lld, \"indirect_blocks\": %lld, \"holes\": %lld, "
+				"\"extents\": %lld, \"fragmented_files\": %d, \"extents_per_file\": %.2f",
+				stats.files, stats.logicalbytes, stats.datablocks, stats.indirectblocks, stats.holes,
+				stats.extents, stats.fragmentedfiles, extentsperfile);
+			if(usedblocks >= 0){
+				debugprint(", \"used_blocks\": %lld, \"free_blocks\": %lld", usedblocks, superblock.nblocks - 1 - usedblocks);
+			}
+			debugprint("}");
+		}
+		else{
+			debugprint("summary:\n");
+			debugprint("\t%d files holding %lld bytes\n", stats.files, stats.logicalbytes);
+			debugprint("\t%lld data blocks, %lld indirect blocks, %lld holes\n", stats.datablocks, stats.indirectblocks, stats.holes);
+			if(usedblocks >= 0){
+				debugprint("\t%lld blocks used, %lld free\n", usedblocks, superblock.nblocks - 1 - usedblocks);
+			}
+			debugprint("\t%lld extents, %d fragmented files, %.2f extents per file\n", stats.extents, stats.fragmentedfiles, extentsperfile);
+		}
+
+		if((super.flags & FS_FLAG_DEDUP) && ismounted){
+			int sharedblocks = 0, savedblocks = 0, i;
+			for(i = 1; i < superblock.nblocks; i++){
+				if(freeblockbitmap[i] > 1){
+					sharedblocks++;
+					savedblocks += freeblockbitmap[i] - 1;
+				}
+			}
+			if(json){
+				debugprint(",\n  \"dedup\": {\"shared_blocks\": %d, \"blocks_saved\": %d}", sharedblocks, savedblocks);
+			}
+			else{
+				debugprint("dedup:\n");
+				debugprint("\t%d shared blocks\n", sharedblocks);
+				debugprint("\t%d blocks saved\n", savedblocks);
+			}
+		}
+
+		if(super.flags & FS_FLAG_COMPRESS){
+			double ratio = stats.datablocks > 0 ? (double)stats.logicalbytes / (double)(stats.datablocks*BLOCK_SIZE) : 0;
+			if(json){
+				debugprint(",\n  \"compression\": {\"compressed_clusters\": %d, \"ratio\": %.2f}", stats.compressedclusters, ratio);
+			}
+			else{
+				debugprint("compression:\n");
+				debugprint("\t%lld bytes stored in %lld data blocks\n", stats.logicalbytes, stats.datablocks);
+				debugprint("\t%d compressed clusters\n", stats.compressedclusters);
+				if(stats.datablocks > 0){
+					debugprint("\tratio %.2f\n", ratio);
+				}
+			}
+		}
+	}
+	putblock(block);
+	if(json){
+		debugprint("\n}\n");
+	}
+	debugflush();
+	fflush(stdout);
+}
+
+/*
+	Consistency check. The live inode table and the inode blocks snapshots own are split
+	between threads, which mark every block they reach in bitsets shared by all of them, one
+	bit per block set with an atomic or, so a million-block image needs well under a megabyte
+	and no locks. Indirect blocks are claimed in a first phase and data blocks in a second, so
+	a block reached both as data and as metadata is caught whichever thread gets to it first.
+	A block with two owners is only an error where neither dedup nor snapshots explain it.
+*/
+#define CHECK_THREADS_MAX 64
+#define CHECK_CHUNK       16 // inode blocks a thread takes at a time
+#define CHECK_REPORT_MAX  20 // problems described one by one, the rest are only counted
+
+#define CHECK_INODE     0
+#define CHECK_RANGE     1
+#define CHECK_DUPLICATE 2
+#define CHECK_CROSSLINK 3
+#define CHECK_CLUSTER   4
+#define CHECK_SNAPSHOT  5
+#define CHECK_COUNTS    6
+#define CHECK_KINDS     7
+
+const char *checknames[CHECK_KINDS] = {
+	"bad inodes", "pointers out of range", "blocks with two owners", "blocks used as data and metadata",
+	"bad compressed cluster lengths", "bad snapshot maps", "reference counts that disagree with the disk"
+};
+
+#define CHECK_PHASE_INDIRECT 0
+#define CHECK_PHASE_DATA     1
+
+struct checkstate {
+	struct fs_superblock super;
+	int firstdata; // lowest block the inode table does not use
+	int datasharing; // dedup or snapshots let data blocks have several owners
+	int metasharing; // snapshots let indirect blocks have several owners
+	int repair; // fix problems as they are found, only ever single threaded
+	int report; // describe problems, not only count them
+	int phase;
+	_Atomic unsigned long long *tablebits; // inode table, snapshot map and snapshot inode blocks
+	_Atomic unsigned long long *indirectbits;
+	_Atomic unsigned long long *databits;
+	_Atomic unsigned long long *scannedbits; // indirect blocks whose pointers were checked
+	int *work; // inode blocks to check
+	int *worktable; // inode table index each of them holds
+	int nwork;
+	_Atomic int nextwork;
+	_Atomic long long problems[CHECK_KINDS];
+	_Atomic int reported;
+};
+
+struct checkstate check;
+
+/* Sets bit b, returning whether it was already set. */
+int markbit(_Atomic unsigned long long *bits, int b){
+	unsigned long long mask = 1ULL << (b & 63);
+	return (atomic_fetch_or(&bits[b >> 6], mask) & mask) != 0;
+}
+
+int testbit(_Atomic unsigned long long *bits, int b){
+	return (atomic_load(&bits[b >> 6]) & (1ULL << (b & 63))) != 0;
+}
+
+/* Counts a problem of the given kind, and describes the first few. */
+void checkproblem(int kind, const char *format, ...){
+	check.problems[kind]++;
+	if(check.report && atomic_fetch_add(&check.reported, 1) < CHECK_REPORT_MAX){
+		char line[256];
+		va_list args;
+		va_start(args, format);
+		vsnprintf(line, sizeof(line), format, args);
+		va_end(args);
+		printf("\t%s%s\n", line, check.repair ? ", repaired" : "");
+	}
+}
+
+/* Returns one if a compressed cluster length may sit at logical block index. */
+int checkclusterlength(int index, int length){
+	int nslots = clusterslots(index / CLUSTER_BLOCKS);
+	if(!(check.super.flags & FS_FLAG_COMPRESS) || index % CLUSTER_BLOCKS != nslots - 1){
+		return 0;
+	}
+	return length > 0 && (length + BLOCK_SIZE - 1) / BLOCK_SIZE < nslots;
+}
+
+/* Checks pointer p at logical block index of inode inumber. Returns one if it can stay. */
+int checkdatapointer(int p, int index, int inumber){
+	if(p == 0){
+		return 1;
+	}
+	if(p < 0){
+		if(!checkclusterlength(index, -p)){
+			checkproblem(CHECK_CLUSTER, "inode %d: block %d holds cluster length %d", inumber, index, -p);
+			return 0;
+		}
+		return 1;
+	}
+	if(p < check.firstdata || p >= check.super.nblocks){
+		checkproblem(CHECK_RANGE, "inode %d: block %d points at %d", inumber, index, p);
+		return 0;
+	}
+	if(testbit(check.tablebits, p) || testbit(check.indirectbits, p)){
+		checkproblem(CHECK_CROSSLINK, "inode %d: data block %d is also metadata", inumber, p);
+		return 0;
+	}
+	if(markbit(check.databits, p) && !check.datasharing){
+		checkproblem(CHECK_DUPLICATE, "inode %d: data block %d already has an owner", inumber, p);
+		return 0;
+	}
+	return 1;
+}
+
+/* Claims indirect block p of inode inumber. Returns one if it can stay. */
+int checkindirectpointer(int p, int inumber){
+	if(p < check.firstdata || p >= check.super.nblocks){
+		checkproblem(CHECK_RANGE, "inode %d: indirect block %d", inumber, p);
+		return 0;
+	}
+	if(testbit(check.tablebits, p)){
+		checkproblem(CHECK_CROSSLINK, "inode %d: indirect block %d is also an inode or map block", inumber, p);
+		return 0;
+	}
+	if(markbit(check.indirectbits, p) && !check.metasharing){
+		checkproblem(CHECK_DUPLICATE, "inode %d: indirect block %d already has an owner", inumber, p);
+		return 0;
+	}
+	return 1;
+}
+
+/* Checks the pointers of indirect block p, the first time any inode reaches it. */
+void checkindirectblock(int p, int inumber){
+	union fs_block *block;
+	int i, dirty = 0;
+	// left alone if the first phase found it unusable
+	if(p < check.firstdata || p >= check.super.nblocks || testbit(check.tablebits, p) || markbit(check.scannedbits, p)){
+		return;
+	}
+	block = getblock();
+	readblock(p, block->data);
+	for(i = 0; i < POINTERS_PER_BLOCK; i++){
+		if(!checkdatapointer(block->pointers[i], POINTERS_PER_INODE + i, inumber) && check.repair){
+			block->pointers[i] = 0;
+			dirty = 1;
+		}
+	}
+	if(dirty){
+		writeblock(p, block->data);
+	}
+	putblock(block);
+}
+
+/* Checks inode block blocknum, which holds table index tableindex, for the current phase. */
+void checkinodeblock(int blocknum, int tableindex){
+	union fs_block *block = getblock();
+	int i, j, dirty = 0;
+	readblock(blocknum, block->data);
+	// only inode 0 of the first block is reserved
+	for(i = (tableindex == 0); i < INODES_PER_BLOCK; i++){
+		struct fs_inode *inode = &block->inode[i];
+		int inumber = tableindex*INODES_PER_BLOCK + i;
+		if(!inodeused(inode)){
+			if(inode->isvalid != 0 && check.phase == CHECK_PHASE_DATA){
+				checkproblem(CHECK_INODE, "inode %d: state %d", inumber, inode->isvalid);
+				if(check.repair){
+					memset(inode, 0, sizeof(struct fs_inode));
+					dirty = 1;
+				}
+			}
+			continue;
+		}
+		if(check.phase == CHECK_PHASE_INDIRECT){
+			if(inode->indirect != 0 && !checkindirectpointer(inode->indirect, inumber) && check.repair){
+				inode->indirect = 0;
+				dirty = 1;
+			}
+			continue;
+		}
+		// holes are allowed, but not a size the block map cannot reach
+		if(inode->size < 0 || (long long)inode->size > (long long)BLOCKS_PER_FILE*BLOCK_SIZE){
+			checkproblem(CHECK_INODE, "inode %d: size %d", inumber, inode->size);
+			if(check.repair){
+				inode->size = inode->size < 0 ? 0 : BLOCKS_PER_FILE*BLOCK_SIZE;
+				dirty = 1;
+			}
+		}
+		for(j = 0; j < POINTERS_PER_INODE; j++){
+			if(!checkdatapointer(inode->direct[j], j, inumber) && check.repair){
+				inode->direct[j] = 0;
+				dirty = 1;
+			}
+		}
+		if(inode->indirect != 0){
+			checkindirectblock(inode->indirect, inumber);
+		}
+	}
+	if(dirty){
+		writeblock(blocknum, block->data);
+	}
+	putblock(block);
+}
+
+void *checkthread(void *arg){
+	int first, i;
+	while((first = atomic_fetch_add(&check.nextwork, CHECK_CHUNK)) < check.nwork){
+		for(i = first; i < first + CHECK_CHUNK && i < check.nwork; i++){
+			checkinodeblock(check.work[i], check.worktable[i]);
+		}
+	}
+	return 0;
+}
+
+/* Runs one phase over the work list with nthreads threads, the caller being one of them. */
+void checkphase(int phase, int nthreads){
+	pthread_t threads[CHECK_THREADS_MAX];
+	int i, started = 0;
+	check.phase = phase;
+	check.nextwork = 0;
+	for(i = 1; i < nthreads; i++){
+		if(pthread_create(&threads[started], 0, checkthread, 0) == 0){
+			started++;
+		}
+	}
+	checkthread(0);
+	for(i = 0; i < started; i++){
+		pthread_join(threads[i], 0);
+	}
+}
+
+/* Marks block p as part of a snapshot map, returning zero if it is out of range or already in use. */
+int checkmapblock(int p, _Atomic unsigned long long *mapbits){
+	if(p < check.firstdata || p >= check.super.nblocks || markbit(check.tablebits, p)){
+		return 0;
+	}
+	markbit(mapbits, p);
+	return 1;
+}
+
+/*
+	Finds the inode blocks to check, marking the inode table and snapshot blocks as it goes,
+	then runs both phases. Snapshot maps are checked here, before any thread starts.
+*/
+void checkpass(int nthreads){
+	int nwords = (check.super.nblocks + 63) / 64;
+	int nmap = snapmapblocks(check.super.ninodeblocks);
+	int usable[FS_SNAPSHOT_MAX];
+	union fs_block *indexes[FS_SNAPSHOT_MAX];
+	_Atomic unsigned long long *mapbits = calloc(nwords, sizeof(unsigned long long)); // blocks holding snapshot maps
+	int i, j, k, dirtysuper = 0;
+
+	memset(check.problems, 0, sizeof(check.problems));
+	check.reported = 0;
+	check.tablebits = calloc(nwords, sizeof(unsigned long long));
+	check.indirectbits = calloc(nwords, sizeof(unsigned long long));
+	check.databits = calloc(nwords, sizeof(unsigned long long));
+	check.scannedbits = calloc(nwords, sizeof(unsigned long long));
+	check.work = malloc(check.super.ninodeblocks * (FS_SNAPSHOT_MAX + 1) * sizeof(int));
+	check.worktable = malloc(check.super.ninodeblocks * (FS_SNAPSHOT_MAX + 1) * sizeof(int));
+	check.nwork = 0;
+
+	for(i = 1; i <= check.super.ninodeblocks; i++){
+		markbit(check.tablebits, i);
+		check.work[check.nwork] = i;
+		check.worktable[check.nwork++] = i - 1;
+	}
+	// a snapshot whose map blocks are unusable is dropped whole
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		struct fs_snapshot *snap = &check.super.snapshots[i];
+		int bad = snap->mapblock;
+		usable[i] = snapshotused(snap);
+		indexes[i] = 0;
+		// no map blocks yet, every inode block is shared
+		if(!usable[i] || snap->mapblock == 0){
+			continue;
+		}
+		if(checkmapblock(snap->mapblock, mapbits)){
+			indexes[i] = getblock();
+			readblock(snap->mapblock, indexes[i]->data);
+			bad = 0;
+			for(k = 0; k < nmap && !bad; k++){
+				int p = indexes[i]->pointers[k];
+				if(p != 0 && !checkmapblock(p, mapbits)){
+					bad = p;
+				}
+			}
+		}
+		if(bad){
+			checkproblem(CHECK_SNAPSHOT, "snapshot %.*s: map block %d", FS_SNAPSHOT_NAME, snap->name, bad);
+			usable[i] = 0;
+			if(check.repair){
+				memset(snap, 0, sizeof(struct fs_snapshot));
+				dirtysuper = 1;
+			}
+		}
+	}
+	union fs_block *map = getblock();
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		struct fs_snapshot *snap = &check.super.snapshots[i];
+		if(!usable[i] || !indexes[i]){
+			continue;
+		}
+		for(k = 0; k < nmap; k++){
+			int first = k*POINTERS_PER_BLOCK;
+			int dirty = 0;
+			if(indexes[i]->pointers[k] == 0){
+				continue;
+			}
+			readblock(indexes[i]->pointers[k], map->data);
+			for(j = first; j < check.super.ninodeblocks && j < first + POINTERS_PER_BLOCK; j++){
+				int p = map->pointers[j - first];
+				// still sharing the live block
+				if(p == 0){
+					continue;
+				}
+				if(p < check.firstdata || p >= check.super.nblocks || testbit(mapbits, p)){
+					checkproblem(CHECK_SNAPSHOT, "snapshot %.*s: inode block %d kept in %d", FS_SNAPSHOT_NAME, snap->name, j + 1, p);
+					if(check.repair){
+						map->pointers[j - first] = 0;
+						dirty = 1;
+					}
+					continue;
+				}
+				// snapshots taken while the block was unchanged share one copy, checked once
+				if(!markbit(check.tablebits, p)){
+					check.work[check.nwork] = p;
+					check.worktable[check.nwork++] = j;
+				}
+			}
+			if(dirty){
+				writeblock(indexes[i]->pointers[k], map->data);
+			}
+		}
+	}
+	putblock(map);
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		if(indexes[i]){
+			putblock(indexes[i]);
+		}
+	}
+	free(mapbits);
+	if(dirtysuper){
+		union fs_block *block = getblock();
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+		block->super = check.super;
+		disk_write(0, block->data);
+		putblock(block);
+	}
+
+	checkphase(CHECK_PHASE_INDIRECT, nthreads);
+	checkphase(CHECK_PHASE_DATA, nthreads);
+
+	free(check.work);
+	free(check.worktable);
+}
+
+void checkfree(){
+	free(check.tablebits);
+	free(check.indirectbits);
+	free(check.databits);
+	free(check.scannedbits);
+}
+
+/*
+	Checks the filesystem on disk: inode states and sizes, pointers that leave the data area,
+	blocks with two owners or used both as data and metadata, compressed cluster lengths and
+	snapshot maps. Free space is not stored on disk, so on a mounted filesystem the reference
+	counts built at mount are compared with what the disk holds, catching leaked blocks.
+	FS_CHECK_REPAIR fixes what it finds on an unmounted disk by dropping the bad pointers in
+	inode table order, so the first owner of a block keeps it, then checks again.
+	Returns the number of problems left, or -1 if there is no filesystem to check.
+*/
+int fs_check( const struct fs_check_options *opts )
+{
+	union fs_block *block = getblock();
+	struct fs_superblock super;
+	int nthreads = opts && opts->nthreads > 0 ? opts->nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	int repair = opts && (opts->flags & FS_CHECK_REPAIR);
+	long long found = 0, left, used = 0;
+	int i;
+
+	appendflush();
+	disk_read(0, block->data);
+	super = block->super;
+	putblock(block);
+	if(super.magic != FS_MAGIC){
+		printf("Error: no filesystem found\n");
+		return -1;
+	}
+	if(repair && ismounted){
+		printf("Error: cannot repair a mounted filesystem\n");
+		return -1;
+	}
+	if(!ismounted && !setgeometry(super.blocksize)){
+		printf("Error: unsupported block size %d\n", super.blocksize);
+		return -1;
+	}
+	if(super.ninodeblocks < 1 || super.nblocks <= super.ninodeblocks + 1
+		|| (long long)super.nblocks*sectorsperblock > disk_size() || super.ninodes != super.ninodeblocks*INODES_PER_BLOCK){
+		printf("Error: superblock describes %d blocks, %d inode blocks and %d inodes, which do not fit\n",
+			super.nblocks, super.ninodeblocks, super.ninodes);
+		return -1;
+	}
+	if(nthreads < 1){
+		nthreads = 1;
+	}
+	if(nthreads > CHECK_THREADS_MAX){
+		nthreads = CHECK_THREADS_MAX;
+	}
+
+	memset(&check, 0, sizeof(check));
+	check.super = super;
+	check.firstdata = super.ninodeblocks + 1;
+	check.metasharing = 0;
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		check.metasharing |= snapshotused(&super.snapshots[i]);
+	}
+	check.datasharing = check.metasharing || (super.flags & FS_FLAG_DEDUP);
+	check.report = 1;
+
+	printf("checking %d blocks with %d threads\n", check.super.nblocks, nthreads);
+	checkpass(nthreads);
+
+	// reference counts are only in memory, so only a mounted filesystem can leak blocks
+	if(ismounted){
+		needrefcounts();
+		for(i = 1; i < check.super.nblocks; i++){
+			int reached = testbit(check.tablebits, i) || testbit(check.indirectbits, i) || testbit(check.databits, i);
+			if(reached != (freeblockbitmap[i] > 0)){
+				checkproblem(CHECK_COUNTS, "block %d: %d references, %s", i, freeblockbitmap[i], reached ? "in use" : "unused");
+			}
+		}
+	}
+
+	for(i = 0; i < CHECK_KINDS; i++){
+		if(check.problems[i] > 0){
+			printf("\t%lld %s\n", (long long)check.problems[i], checknames[i]);
+			found += check.problems[i];
+		}
+	}
+
+	left = found;
+	if(found > 0 && repair){
+		// the repair pass runs alone so the same owner of a block wins every time
+		checkfree();
+		check.repair = 1;
+		check.report = 0;
+		checkpass(1);
+		check.repair = 0;
+		checkfree();
+		checkpass(nthreads);
+		left = 0;
+		for(i = 0; i < CHECK_KINDS; i++){
+			left += check.problems[i];
+		}
+		printf("%lld problems repaired, %lld left\n", found - left, left);
+	}
+
+	for(i = 0; i < (check.super.nblocks + 63) / 64; i++){
+		used += __builtin_popcountll(check.tablebits[i] | check.indirectbits[i] | check.databits[i]);
+	}
+	// plus the superblock
+	printf("%lld problems found, %lld of %d blocks in use\n", found, used + 1, check.super.nblocks);
+	checkfree();
+	fflush(stdout);
+	return left;
+}
+
+/* Frees what the current mount built, once nothing is scanning it. Counts never built are not built now. */
+void releasemount(){
+	int currsnap;
+	if(refcountstate == REFCOUNTS_SCANNING){
+		pthread_join(scanthread, 0);
+	}
+	refcountstate = REFCOUNTS_READY;
+	free(freeblockbitmap);
+	for(currsnap = 0; currsnap < FS_SNAPSHOT_MAX; currsnap++){
+		free(snapmaps[currsnap]);
+		free(snapindexes[currsnap]);
+		snapmaps[currsnap] = 0;
+		snapindexes[currsnap] = 0;
+	}
+	if(superblock.flags & FS_FLAG_DEDUP){
+		free(blockhash);
+		free(hashnext);
+		free(hashbuckets);
+	}
+}
+
+/*
+	Mounts the live filesystem, or with snapshot 0 or above that snapshot read-only.
+	Reference counts always cover the live inode table and every snapshot. They are built
+	before returning unless flags ask for a lazy mount, which only checks the superblock and
+	loads the snapshot maps. Read-only snapshot mounts are always lazy.
+*/
+int mountfs(int snapshot, int flags)
+{
+	union fs_block *block = getblock();
+	struct fs_superblock super;
+
+	// a remount must not lose a pending append
+	appendflush();
+	disk_read(0, block->data);
+	super = block->super;
+	putblock(block);
+
+	// check if the filesystem is present
+	if(super.magic == FS_MAGIC){
+		int currsnap;
+		if(!setgeometry(super.blocksize)){
+			printf("Error: unsupported block size %d\n", super.blocksize);
+			return 0;
+		}
+		const char *image = 0;
+		if(flags & FS_MOUNT_READONLY){
+			image = disk_map();
+			if(!image || (long long)super.nblocks*sectorsperblock > disk_size()){
+				printf("Error: a read-only mount needs a single image file holding the whole filesystem\n");
+				return 0;
+			}
+			// readers never look at the reference counts
+			flags = (flags & ~FS_MOUNT_BACKGROUND) | FS_MOUNT_LAZY;
+		}
+		if(ismounted){
+			releasemount();
+		}
+		superblock = super;
+		freeinodehint = 0;
+		defragcursor = 1;
+		mountedsnapshot = snapshot;
+		mapped = image;
+		mapcacheclear();
+		allocreset();
+		freeblockbitmap = calloc(super.nblocks, sizeof(int));
+		if(superblock.flags & FS_FLAG_DEDUP){
+			dedupinit(superblock.nblocks);
+		}
+		for(currsnap = 0; currsnap < FS_SNAPSHOT_MAX; currsnap++){
+			if(snapshotused(&superblock.snapshots[currsnap])){
+				loadsnapmap(currsnap);
+			}
+		}
+
+		if(snapshot >= 0 && !(flags & FS_MOUNT_BACKGROUND)){
+			flags |= FS_MOUNT_LAZY;
+		}
+		// the warm-up only goes in front of the first read on a full mount, lazy ones skip it
+		scanwarm = snapshot < 0 && !image;
+		if(flags & FS_MOUNT_BACKGROUND){
+			refcountstate = REFCOUNTS_SCANNING;
+			if(pthread_create(&scanthread, 0, runscan, 0) != 0){
+				refcountstate = REFCOUNTS_PENDING;
+			}
+		}
+		else if(flags & FS_MOUNT_LAZY){
+			refcountstate = REFCOUNTS_PENDING;
+		}
+		else{
+			if(scanwarm){
+				mapcachewarm();
+			}
+			scanrefcounts();
+			refcountstate = REFCOUNTS_READY;
+		}
+	}
+	ismounted = 1;
+	/*
+	int i;
+	for(i = 0; i < block.super.nblocks; i++){
+		printf("Inodenumber %d: %d\n", i,freeblockbitmap[i]);
+	}*/
+	return ismounted;
+}
+
+int fs_mount()
+{
+	return mountfs(-1, 0);
+}
+
+int fs_mount_with( int flags )
+{
+	return mountfs(-1, flags);
+}
+
+/*
+	Unmounts, saving the block map cache's warm-up list in the superblock of a writable mount
+	and printing how the cache did.
+*/
+int fs_unmount()
+{
+	if(!ismounted){
+		return 0;
+	}
+	if(superblock.magic == FS_MAGIC){
+		appendflush();
+		if(mountedsnapshot < 0 && !mapped){
+			savesuperblock();
+			mapcachereport();
+		}
+		releasemount();
+	}
+	superblock.magic = 0;
+	mapped = 0;
+	ismounted = 0;
+	return 1;
+}
+
+// to run from here on out you must first mount the disk
+int fs_create()
+{
+	return fs_create_with(0);
+}
+
+int fs_create_with( int flags )
+{
+	// check to see if it ismounted
+	if(ismounted){
+		union fs_block *block;
+		int currblock;
+		if(readonlymount()){
+			return 0;
+		}
+		needrefcounts();
+		block = getblock();
+		// every inode below the hint is known to be in use
+		for(currblock = freeinodehint/INODES_PER_BLOCK + 1; currblock <= superblock.ninodeblocks; currblock++){
+			readblock(currblock, block->data);
+			int currinode;
+			for(currinode = 0; currinode < INODES_PER_BLOCK; currinode++){
+				int inumber = (currblock-1)*INODES_PER_BLOCK + currinode;
+				// inode already created, inode 0 is never handed out
+				if(inumber == 0 || inodeused(&block->inode[currinode])){
+					continue;
+				}
+				// a snapshot may still share this inode block
+				if(!unshareinodeblock(currblock)){
+					putblock(block);
+					return 0;
+				}
+				// inode not created, so create it
+				block->inode[currinode].isvalid = (flags & FS_CREATE_DIR) ? INODE_DIR : INODE_FILE;
+				block->inode[currinode].size = 0; // set the length to be 0
+				/* zeroing out direct blocks and indirect blocks */
+				int directblock;
+				for(directblock = 0; directblock < POINTERS_PER_INODE; directblock++){
+					block->inode[currinode].direct[directblock] = 0;
+				}
+				block->inode[currinode].indirect = 0;
+				writeblock(currblock, block->data);
+				putblock(block);
+				freeinodehint = inumber + 1;
+				return inumber;
+			}
+		}
+		putblock(block);
+		freeinodehint = superblock.ninodes;
+	}
+	else{
+		printf("Error: Disk not mounted\n");
+	}
+	return 0;
+}
+
+int fs_delete( int inumber )
+{
+	if(ismounted){
+		if(!(checkinode(inumber))){
+			printf("Error invalid inumber\n");
+			return 0;
+		}
+		if(!writableinode(inumber)){
+			return 0;
+		}
+		struct fs_inode inode;
+		loadinode(inumber, &inode);
+		int currblock;
+		releasehold(inumber);
+		discardbegin();
+		for(currblock = 0; currblock < POINTERS_PER_INODE; currblock++){
+			freeblock(inode.direct[currblock]); // free bitmap
+		}
+		// the indirect block and what it points at, unless a snapshot still shares it
+		dropindirect(inode.indirect);
+		memset(&inode, 0, sizeof(struct fs_inode));
+		saveinode(inumber, &inode);
+		discardend();
+		if(inumber < freeinodehint){
+			freeinodehint = inumber;
+		}
+		return 1;
+	}
+	else{
+		printf("Error: Disk not mounted\n");
+	}
+	// check to see if it ismounted
+	return 0;
+}
+
+int fs_getsize( int inumber )
+{
+	// check to if ismounted
+	if(ismounted){
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		struct fs_inode inode;
+		loadinode(inumber, &inode);
+		return inode.size;
+	}
+	else{
+		printf("Error: disk not mounted\n");
+	}
+	return -1;
+}
+
+// one if inumber was created with FS_CREATE_DIR, zero for a file or a free inode
+int fs_isdir( int inumber )
+{
+	if(ismounted && checkinode(inumber)){
+		struct fs_inode inode;
+		loadinode(inumber, &inode);
+		return inode.isvalid == INODE_DIR;
+	}
+	return 0;
+}
+
+/*
+	Reads a cluster of a compressed file into buffer, CLUSTER_SIZE bytes.
+	A cluster whose last pointer is negative holds that many bytes of compressed data
+	in its leading blocks, otherwise its blocks are stored raw. Missing blocks read as zeros.
+	Returns one on success, zero if the cluster is corrupt.
+*/
+int loadcluster(struct fs_inode *inode, int cluster, char *buffer){
+	int map[CLUSTER_BLOCKS];
+	int nslots = clusterslots(cluster);
+	int i;
+
+	memset(buffer, 0, CLUSTER_SIZE);
+	readblockmap(inode, cluster*CLUSTER_BLOCKS, nslots, map);
+
+	if(nslots > 0 && map[nslots-1] < 0){
+		char *packed;
+		int packedlength = -map[nslots-1];
+		int nblocks = (packedlength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		int ok;
+		if(nblocks >= nslots){
+			printf("Error: corrupt compressed cluster\n");
+			return 0;
+		}
+		for(i = 0; i < nblocks; i++){
+			if(map[i] <= 0){
+				printf("Error: corrupt compressed cluster\n");
+				return 0;
+			}
+		}
+		packed = mapped ? threadclusters() + MAX_CLUSTER_SIZE : getcluster();
+		for(i = 0; i < nblocks; i++){
+			readblock(map[i], packed + i*BLOCK_SIZE);
+		}
+		ok = lz_decompress(packed, packedlength, buffer, CLUSTER_SIZE) >= 0;
+		if(!mapped){
+			putcluster(packed);
+		}
+		if(!ok){
+			printf("Error: corrupt compressed cluster\n");
+			return 0;
+		}
+		return 1;
+	}
+
+	for(i = 0; i < nslots; i++){
+		if(map[i] > 0){
+			readblock(map[i], buffer + i*BLOCK_SIZE);
+		}
+	}
+	return 1;
+}
+
+/* fs_read for compressed filesystems, decompresses one cluster at a time */
+int readclusters(struct fs_inode *inode, char *data, int length, int offset){
+	char *clusterbuf = mapped ? threadclusters() : getcluster();
+	int bytesleft = length;
+	int currcluster = offset / CLUSTER_SIZE;
+	int curroffset = offset % CLUSTER_SIZE;
+
+	while(bytesleft > 0){
+		int lengthToCopy = CLUSTER_SIZE - curroffset;
+		if(lengthToCopy > bytesleft){
+			lengthToCopy = bytesleft;
+		}
+		if(!loadcluster(inode, currcluster, clusterbuf)){
+			break;
+		}
+		memcpy(data, clusterbuf + curroffset, lengthToCopy);
+		data += lengthToCopy;
+		bytesleft -= lengthToCopy;
+		curroffset = 0;
+		currcluster += 1;
+	}
+	if(!mapped){
+		putcluster(clusterbuf);
+	}
+	return length - bytesleft;
+}
+
+#define READ_WINDOW 256 // block pointers looked up at a time, small enough for any thread's stack
+
+/* fs_read for plain filesystems, whole blocks that sit next to each other on disk go in one transfer */
+int readblocks(struct fs_inode *inode, char *data, int length, int offset){
+	int map[READ_WINDOW];
+	int mapfirst = -READ_WINDOW; // block the window starts at, relative to firstblock
+	int bytesleft = length;
+	int firstblock = offset / BLOCK_SIZE;
+	int currblock = 0; // current block, relative to firstblock
+	int curroffset = offset % BLOCK_SIZE; // offset within the given block
+	int nblocks = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE - firstblock;
+
+	if(firstblock + nblocks > BLOCKS_PER_FILE){
+		nblocks = BLOCKS_PER_FILE - firstblock;
+	}
+
+	// loop through the data
+	while(bytesleft > 0 && currblock < nblocks){
+		if(currblock >= mapfirst + READ_WINDOW){
+			mapfirst = currblock;
+			readblockmap(inode, firstblock + mapfirst, nblocks - mapfirst < READ_WINDOW ? nblocks - mapfirst : READ_WINDOW, map);
+		}
+		int currblocknum = map[currblock - mapfirst]; // block number that is pointed to
+		int runlength = 1;
+
+		if(curroffset == 0 && currblocknum > 0){
+			while(currblock + runlength < nblocks && currblock + runlength < mapfirst + READ_WINDOW
+			      && (runlength+1)*BLOCK_SIZE <= bytesleft
+			      && map[currblock - mapfirst + runlength] == currblocknum + runlength){
+				runlength++;
+			}
+		}
+		if(runlength > 1){
+			readblockrun(currblocknum, runlength, data);
+			data += runlength*BLOCK_SIZE;
+			bytesleft -= runlength*BLOCK_SIZE;
+			currblock += runlength;
+			continue;
+		}
+
+		/* Reading Data */
+		int lengthToCopy = BLOCK_SIZE - curroffset;
+		if(lengthToCopy > bytesleft){
+			lengthToCopy = bytesleft;
+		}
+		if(currblocknum == 0){
+			// holes read as zeros without touching the disk
+			memset(data, 0, lengthToCopy);
+		}
+		else if(lengthToCopy == BLOCK_SIZE){
+			// a whole block goes straight into the caller's buffer
+			readblock(currblocknum, data);
+		}
+		else if(mapped){
+			memcpy(data, mappedblock(currblocknum) + curroffset, lengthToCopy);
+		}
+		else{
+			union fs_block *bufferBlock = getblock();
+			readblock(currblocknum, bufferBlock->data);
+			memcpy(data, bufferBlock->data + curroffset, lengthToCopy);
+			putblock(bufferBlock);
+		}
+		data += lengthToCopy;
+		bytesleft -= lengthToCopy;
+
+		curroffset = 0;
+		currblock += 1;
+	}
+	return length - bytesleft;
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	if(ismounted){
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		// overall inode
+		struct fs_inode masterinode;
+
+		/* Loading the iNode */
+		loadinode(inumber, &masterinode);
+
+		// check if the offset is greater than the size of the inode if so then break
+		if(offset < 0 || length < 0 || offset >= masterinode.size){
+			return 0;
+		}
+
+		/* Computing Length of Bytes We are Going to Read */
+		int actlength;
+		// iNode size greater than what we want to read, compared so the sum cannot overflow
+		if(length > masterinode.size - offset){
+			actlength = masterinode.size - offset; 
+		}
+		else{
+			actlength = length; 
+		}
+
+		if(superblock.flags & FS_FLAG_COMPRESS){
+			return readclusters(&masterinode, data, actlength, offset);
+		}
+		return readblocks(&masterinode, data, actlength, offset);
+	}
+	else{
+		printf("Error: disk not mounted\n");
+	}
+	return 0;
+}
+
+int findfreeindirectblock(struct fs_inode *inode){
+	int currblocknum = findfreeblock();
+	if(currblocknum == -1){
+		return -1;
+	}
+	inode->indirect = currblocknum;
+	// the old contents are garbage, so the block is written without reading it first
+	union fs_block *block = getblock();
+	blankblock(block->data);
+	writeblock(inode->indirect, block->data);
+	putblock(block);
+	return inode->indirect;
+}
+
+/*
+	Stores map as the block pointers for logical blocks first .. first+count-1 of the inode,
+	allocating the indirect block if it is needed. Returns one on success, zero if no block is free.
+*/
+int writeblockmap(struct fs_inode *inode, int first, int count, const int *map){
+	int *pointers = 0;
+	int dirty = 0;
+	int i;
+	for(i = 0; i < count; i++){
+		int index = first + i;
+		if(index < POINTERS_PER_INODE){
+			inode->direct[index] = map[i];
+			continue;
+		}
+		if(index >= BLOCKS_PER_FILE){
+			break;
+		}
+		if(!pointers){
+			if(inode->indirect <= 0){
+				if(map[i] == 0){
+					continue;
+				}
+				if(findfreeindirectblock(inode) == -1){
+					printf("No free indirect blocks\n");
+					return 0;
 				}
+			}
+			// the cached copy is the block, written back below
+			pointers = cachedindirect(inode->indirect);
+		}
+		if(pointers[index - POINTERS_PER_INODE] != map[i]){
+			pointers[index - POINTERS_PER_INODE] = map[i];
+			dirty = 1;
+		}
+	}
+	if(dirty){
+		writeblock(inode->indirect, (char *)pointers);
+	}
+	return 1;
+}
+
+/*
+	Compresses the first length bytes of buffer into cluster number cluster of the inode.
+	If the data does not compress into fewer blocks than the cluster has, it is stored raw.
+	The cluster's old blocks are released first so the new layout can reuse them.
+	Returns one on success, zero if the disk is full, in which case the old contents are kept.
+*/
+int writecluster(struct fs_inode *inode, int cluster, const char *buffer, int length){
+	int oldmap[CLUSTER_BLOCKS];
+	int newmap[CLUSTER_BLOCKS];
+	char *packed = getcluster();
+	int nslots = clusterslots(cluster);
+	const char *source = buffer;
+	int sourcelength = length;
+	int packedlength, nblocks, i;
+
+	readblockmap(inode, cluster*CLUSTER_BLOCKS, nslots, oldmap);
+
+	// a cluster of zeros is stored as holes
+	if(iszero(buffer, length)){
+		packedlength = 0;
+		sourcelength = 0;
+	}
+	else{
+		packedlength = lz_compress(buffer, length, packed, (nslots-1)*BLOCK_SIZE);
+	}
+	if(packedlength > 0){
+		source = packed;
+		sourcelength = packedlength;
+	}
+	nblocks = (sourcelength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	for(i = 0; i < nslots; i++){
+		freeblock(oldmap[i]);
+	}
+	memset(newmap, 0, sizeof(newmap));
+	for(i = 0; i < nblocks; i++){
+		newmap[i] = allocblock(i > 0 ? newmap[i-1] + 1 : blockgoal(inode, cluster*CLUSTER_BLOCKS), 1);
+		if(newmap[i] == -1){
+			newmap[i] = 0;
+			break;
+		}
+	}
+	if(packedlength > 0){
+		newmap[nslots-1] = -packedlength;
+	}
+	if(i < nblocks || !writeblockmap(inode, cluster*CLUSTER_BLOCKS, nslots, newmap)){
+		/* put the old layout back */
+		for(i = 0; i < nblocks; i++){
+			freeblock(newmap[i]);
+		}
+		for(i = 0; i < nslots; i++){
+			if(oldmap[i] > 0){
+				freeblockbitmap[oldmap[i]]++;
+			}
+		}
+		putcluster(packed);
+		printf("Error: No Valid Block Available\n");
+		return 0;
+	}
+
+	for(i = 0; i < nblocks; i++){
+		int chunk = sourcelength - i*BLOCK_SIZE;
+		if(chunk >= BLOCK_SIZE){
+			writeblock(newmap[i], source + i*BLOCK_SIZE);
+			continue;
+		}
+		// only the last block is partial and needs padding
+		union fs_block *bufferBlock = getblock();
+		memcpy(bufferBlock->data, source + i*BLOCK_SIZE, chunk);
+		memset(bufferBlock->data + chunk, 0, BLOCK_SIZE - chunk);
+		writeblock(newmap[i], bufferBlock->data);
+		putblock(bufferBlock);
+	}
+	putcluster(packed);
+	return 1;
+}
+
+/* fs_write for compressed filesystems, each touched cluster is merged with its old contents and recompressed */
+int writeclusters(struct fs_inode *inode, const char *data, int length, int offset){
+	char *clusterbuf = getcluster();
+	int bytesleft = length;
+	int currcluster = offset / CLUSTER_SIZE;
+	int curroffset = offset % CLUSTER_SIZE;
+
+	while(bytesleft > 0){
+		int clusterstart = currcluster * CLUSTER_SIZE;
+		int clusterlength = clusterslots(currcluster) * BLOCK_SIZE;
+		if(curroffset >= clusterlength){
+			break; // past the largest possible file
+		}
+		int lengthToCopy = clusterlength - curroffset;
+		if(lengthToCopy > bytesleft){
+			lengthToCopy = bytesleft;
+		}
+		// bytes of this cluster that hold file data
+		int validlength = inode->size - clusterstart;
+		if(validlength < 0){
+			validlength = 0;
+		}
+		if(validlength > clusterlength){
+			validlength = clusterlength;
+		}
+		if(validlength > 0 && (curroffset > 0 || lengthToCopy < validlength)){
+			if(!loadcluster(inode, currcluster, clusterbuf)){
+				break;
+			}
+		}
+		else{
+			memset(clusterbuf, 0, CLUSTER_SIZE);
+		}
+		memcpy(clusterbuf + curroffset, data, lengthToCopy);
+		if(curroffset + lengthToCopy > validlength){
+			validlength = curroffset + lengthToCopy;
+		}
+		if(!writecluster(inode, currcluster, clusterbuf, validlength)){
+			break;
+		}
+		data += lengthToCopy;
+		bytesleft -= lengthToCopy;
+		curroffset = 0;
+		currcluster += 1;
+	}
+	putcluster(clusterbuf);
+	return length - bytesleft;
+}
+
+/*
+	Writes length bytes at offset within logical block index of a dedup filesystem.
+	The new contents go to an existing identical block if there is one. Otherwise an exclusively
+	owned block is updated in place, and a shared block is copied on write.
+	Returns one on success, zero if the disk is full.
+*/
+int writededupblock(struct fs_inode *inode, int index, int oldblock, const char *data, int length, int offset){
+	union fs_block *bufferBlock = getblock();
+	unsigned long long hash;
+	int newblock;
+
+	if(length < BLOCK_SIZE){
+		if(oldblock > 0){
+			readblock(oldblock, bufferBlock->data);
+		}
+		else{
+			blankblock(bufferBlock->data);
+		}
+	}
+	memcpy(bufferBlock->data + offset, data, length);
+	hash = hashblock(bufferBlock->data);
+
+	newblock = deduplookup(bufferBlock->data, hash);
+	if(newblock == oldblock && oldblock > 0){
+		putblock(bufferBlock);
+		return 1; // contents did not change
+	}
+	if(newblock > 0){
+		/* share the existing copy */
+		freeblockbitmap[newblock]++;
+	}
+	else if(oldblock > 0 && freeblockbitmap[oldblock] == 1){
+		/* only this file uses the block, update it in place */
+		dedupremove(oldblock);
+		writeblock(oldblock, bufferBlock->data);
+		dedupinsert(oldblock, hash);
+		putblock(bufferBlock);
+		return 1;
+	}
+	else{
+		/* new block, or copy on write of a shared one */
+		newblock = allocblock(blockgoal(inode, index), 1);
+		if(newblock == -1){
+			putblock(bufferBlock);
+			printf("Error: No Valid Block Available\n");
+			return 0;
+		}
+		writeblock(newblock, bufferBlock->data);
+		dedupinsert(newblock, hash);
+	}
+	putblock(bufferBlock);
+	if(!writeblockmap(inode, index, 1, &newblock)){
+		freeblock(newblock);
+		return 0;
+	}
+	freeblock(oldblock);
+	return 1;
+}
+
+/*
+	Writes length bytes at offset within logical block index, allocating the block if it is a hole
+	and copying it first if a snapshot shares it.
+*/
+int writeplainblock(struct fs_inode *inode, int index, int blocknum, const char *data, int length, int offset){
+	union fs_block *bufferBlock;
+	int oldblock = blocknum;
+
+	/* check for free block */
+	if(blocknum == 0 || freeblockbitmap[blocknum] > 1){
+		blocknum = allocblock(blockgoal(inode, index), 1);
+		if(blocknum == -1){
+			printf("Error: No Valid Block Available\n");
+			return 0;
+		}
+		if(!writeblockmap(inode, index, 1, &blocknum)){
+			freeblock(blocknum);
+			return 0;
+		}
+	}
+
+	// a whole block goes to the disk straight from the caller, only a partly overwritten one needs its old contents
+	if(length == BLOCK_SIZE){
+		writeblock(blocknum, data);
+	}
+	else{
+		bufferBlock = getblock();
+		if(oldblock == 0){
+			blankblock(bufferBlock->data);
+		}
+		else{
+			readblock(oldblock, bufferBlock->data);
+		}
+		memcpy(bufferBlock->data + offset, data, length);
+		writeblock(blocknum, bufferBlock->data);
+		putblock(bufferBlock);
+	}
+	if(oldblock != blocknum){
+		freeblock(oldblock);
+	}
+	return 1;
+}
+
+/* Turns logical block index back into a hole, releasing the block behind it. */
+int punchhole(struct fs_inode *inode, int index, int blocknum){
+	int hole = 0;
+	if(blocknum == 0){
+		return 1;
+	}
+	if(!writeblockmap(inode, index, 1, &hole)){
+		return 0;
+	}
+	freeblock(blocknum);
+	return 1;
+}
+
+/* fs_write for plain filesystems, allocates blocks as the write goes past them */
+int writeblocks(struct fs_inode *inode, const char *data, int length, int offset){
+	int bytesleft = length;
+	int currblock = offset / BLOCK_SIZE; // current block
+	int curroffset = offset % BLOCK_SIZE; // offset within the given block
+	int currblocknum; // block number that is pointed to
+
+	while(bytesleft > 0){
+		if(currblock >= BLOCKS_PER_FILE){
+			break;
+		}
+		readblockmap(inode, currblock, 1, &currblocknum);
+
+		/* Writing Data */
+		int lengthToCopy = BLOCK_SIZE - curroffset;
+		if(lengthToCopy > bytesleft){
+			lengthToCopy = bytesleft;
+		}
+		int written;
+		// a whole block of zeros is stored as a hole, unless the file has a block of its own there,
+		// which keeps what fallocate reserved
+		if(lengthToCopy == BLOCK_SIZE && (currblocknum == 0 || freeblockbitmap[currblocknum] != 1) && iszeroblock(data)){
+			written = punchhole(inode, currblock, currblocknum);
+		}
+		else if(superblock.flags & FS_FLAG_DEDUP){
+			written = writededupblock(inode, currblock, currblocknum, data, lengthToCopy, curroffset);
+		}
+		else{
+			written = writeplainblock(inode, currblock, currblocknum, data, lengthToCopy, curroffset);
+		}
+		if(!written){
+			break;
+		}
+		data += lengthToCopy;
+		bytesleft -= lengthToCopy;
+
+		curroffset = 0;
+		currblock += 1;
+	}
+	return length - bytesleft;
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{	
+	if(ismounted){
+		// check inode
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		// writing past the end of the file leaves a hole in between, but not past the largest file
+		if(offset < 0 || length < 0 || offset >= MAX_FILE_SIZE || !writableinode(inumber)){
+			return 0;
+		}
+
+		// overall inode
+		struct fs_inode masterinode;
+
+		/* Loading the iNode */
+		loadinode(inumber, &masterinode);
+		if(!ownindirect(&masterinode)){
+			return 0;
+		}
+		// the blocks past the tail are found by goal from here, so the held ones must be free
+		if(offset + length > masterinode.size){
+			releasehold(inumber);
+		}
+
+		// gather the block writes so adjacent ones reach the disk together
+		disk_plug();
+
+		int written;
+		if(superblock.flags & FS_FLAG_COMPRESS){
+			written = writeclusters(&masterinode, data, length, offset);
+		}
+		else{
+			written = writeblocks(&masterinode, data, length, offset);
+		}
+
+		// nothing written leaves the size alone, written is bounded by MAX_FILE_SIZE - offset
+		if(written > 0 && offset + written > masterinode.size){
+			masterinode.size = offset + written;
+		}
+		saveinode(inumber, &masterinode);
+		disk_unplug();
+		return written;
+	}
+	else{
+		printf("Error Disk not Mounted\n");
+	}
+	return 0;
+}
+
+/* Marks the free blocks first to first+count-1 in use the way allocblock does. */
+void takerun(int first, int count){
+	int i;
+	// a block waiting to be punched must be gone before it can hold new data
+	if(ndiscardruns > 0){
+		discardflush();
+	}
+	for(i = first; i < first + count; i++){
+		freeblockbitmap[i] = 1;
+		mapcacheforget(i);
+	}
+	while(lowestfree < superblock.nblocks && freeblockbitmap[lowestfree] != 0){
+		lowestfree++;
+	}
+}
+
+/*
+	Finds count free blocks in a row, first fit, and marks them in use the way allocblock does.
+	Runs step round reservation windows unless nothing else is left.
+	Returns the first block of the run, or -1 if there is no run that long.
+*/
+int findfreerun(int count){
+	int runstart = lowestfree, runlength = 0;
+	int first = -1;
+	int i;
+	first = findunreserved(lowestfree, count, superblock.nblocks);
+	for(i = lowestfree; first == -1 && i < superblock.nblocks; i++){
+		if(freeblockbitmap[i] != 0){
+			runstart = i + 1;
+			runlength = 0;
+			continue;
+		}
+		runlength++;
+		if(runlength == count){
+			first = runstart;
+		}
+	}
+	if(first == -1){
+		return -1;
+	}
+	takerun(first, count);
+	return first;
+}
+
+#define APPEND_RUN 64 // blocks allocated and mapped together, and held ahead of the tail
+
+/*
+	Holds up to APPEND_RUN free blocks in a row ahead of the appended file's tail, from goal
+	while they are free, otherwise the next run that long after goal, or the first anywhere.
+	They are marked in use, so no allocation policy hands them to anyone else.
+*/
+void appendreserve(struct appendhold *h, int goal){
+	int count = 0;
+	while(goal > 0 && count < APPEND_RUN && goal + count < superblock.nblocks && freeblockbitmap[goal + count] == 0){
+		count++;
+	}
+	if(count > 0){
+		takerun(goal, count);
+	}
+	else{
+		count = APPEND_RUN;
+		goal = findunreserved(goal, count, RESERVE_SEARCH);
+		if(goal != -1){
+			takerun(goal, count);
+		}
+		else{
+			goal = findfreerun(count);
+		}
+		if(goal == -1){
+			return;
+		}
+	}
+	h->next = goal;
+	h->count = count;
+}
+
+/* The held run of the appended file, taking the least recently used slot and its blocks if it has none. */
+struct appendhold *appendheld(){
+	struct appendhold *h = &appending.held[0];
+	int i;
+	for(i = 0; i < APPEND_HELD; i++){
+		if(appending.held[i].inumber == appending.inumber){
+			h = &appending.held[i];
+			break;
+		}
+		if(appending.held[i].lastuse < h->lastuse){
+			h = &appending.held[i];
+		}
+	}
+	if(h->inumber != appending.inumber){
+		freehold(h);
+		h->inumber = appending.inumber;
+	}
+	h->lastuse = ++appending.clock;
+	return h;
+}
+
+/* A block for the appended file, the next one held ahead of its tail if there is one. */
+int appendblock(int goal){
+	struct appendhold *h = appendheld();
+	if(h->count == 0){
+		appendreserve(h, goal);
+	}
+	if(h->count > 0){
+		h->count--;
+		return h->next++;
+	}
+	return allocblock(goal, 1);
+}
+
+/*
+	Writes whole and partial blocks past the tail of the appended inode, mapping each run of
+	APPEND_RUN with one writeblockmap and sending consecutive blocks in one transfer. Blocks
+	already there, such as those fs_fallocate reserved, are written in place unless a snapshot
+	shares them, otherwise a block of zeros becomes a hole as in writeblocks.
+	Returns the bytes written.
+*/
+int appendrun(struct fs_inode *inode, int index, const char *data, int length){
+	int map[APPEND_RUN], oldmap[APPEND_RUN];
+	int count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int goal = blockgoal(inode, index);
+	int i, first, bytes;
+	if(count > APPEND_RUN){
+		count = APPEND_RUN;
+	}
+	if(count > BLOCKS_PER_FILE - index){
+		count = BLOCKS_PER_FILE - index;
+	}
+	readblockmap(inode, index, count, oldmap);
+	for(i = 0; i < count; i++){
+		const char *block = data + (size_t)i*BLOCK_SIZE;
+		if(oldmap[i] > 0 && freeblockbitmap[oldmap[i]] == 1){
+			map[i] = oldmap[i];
+			goal = map[i] + 1;
+			continue;
+		}
+		if(length - i*BLOCK_SIZE >= BLOCK_SIZE && iszeroblock(block)){
+			map[i] = 0;
+			continue;
+		}
+		map[i] = appendblock(goal);
+		if(map[i] == -1){
+			printf("Error: No Valid Block Available\n");
+			break;
+		}
+		goal = map[i] + 1;
+	}
+	count = i;
+	if(count == 0 || !writeblockmap(inode, index, count, map)){
+		for(i = 0; i < count; i++){
+			if(map[i] != oldmap[i]){
+				freeblock(map[i]);
+			}
+		}
+		return 0;
+	}
+	// shared blocks that were copied away from
+	for(i = 0; i < count; i++){
+		if(map[i] != oldmap[i]){
+			freeblock(oldmap[i]);
+		}
+	}
+
+	bytes = length < count*BLOCK_SIZE ? length : count*BLOCK_SIZE;
+	// a short last block becomes the new tail, kept for the next append
+	if(bytes % BLOCK_SIZE){
+		blankblock(appending.tail->data);
+		memcpy(appending.tail->data, data + (size_t)(count-1)*BLOCK_SIZE, bytes % BLOCK_SIZE);
+		writeblock(map[count-1], appending.tail->data);
+		count--;
+	}
+	for(first = 0; first < count; first = i){
+		for(i = first + 1; i < count && map[first] > 0 && map[i] == map[i-1] + 1; i++);
+		if(map[first] > 0){
+			writeblockrun(map[first], i - first, data + (size_t)first*BLOCK_SIZE);
+		}
+	}
+	return bytes;
+}
 
-				union fs_block indirectBufferBlock;
-				disk_read(currindirectblock, indirectBufferBlock.data);
-				/* find the offset */
-				currblocknum = indirectBufferBlock.pointers[currblock - POINTERS_PER_INODE];
-
-				/* check for free block for indirect*/
-				if(currblocknum == 0){
-					currblocknum = findfreeblock();
-					if(currblocknum != -1){
-						indirectBufferBlock.pointers[currblock - POINTERS_PER_INODE] = currblocknum;
-						disk_write(currindirectblock, indirectBufferBlock.data);
-					}
-				}
+/*
+	Fills the partial last block of the appended inode from the kept copy, copying it first if it
+	is a hole or a snapshot shares it. Returns the bytes written.
+*/
+int appendtail(struct fs_inode *inode, const char *data, int length){
+	int index = inode->size / BLOCK_SIZE;
+	int offset = inode->size % BLOCK_SIZE;
+	int blocknum, oldblock;
+	if(length > BLOCK_SIZE - offset){
+		length = BLOCK_SIZE - offset;
+	}
+	readblockmap(inode, index, 1, &oldblock);
+	blocknum = oldblock;
+	if(blocknum == 0 || freeblockbitmap[blocknum] > 1){
+		blocknum = appendblock(blockgoal(inode, index));
+		if(blocknum == -1){
+			printf("Error: No Valid Block Available\n");
+			return 0;
+		}
+		if(!writeblockmap(inode, index, 1, &blocknum)){
+			freeblock(blocknum);
+			return 0;
+		}
+		freeblock(oldblock);
+	}
+	memcpy(appending.tail->data + offset, data, length);
+	writeblock(blocknum, appending.tail->data);
+	return length;
+}
+
+/*
+	Writes length bytes at the end of the file. Successive appends to one file keep its inode and
+	last block in memory and save the inode only when something else needs it, see appendflush.
+	Compressed and dedup filesystems go through fs_write.
+*/
+int fs_append( int inumber, const char *data, int length )
+{
+	if(!ismounted){
+		printf("Error Disk not Mounted\n");
+		return 0;
+	}
+	if(appending.inumber != inumber || inumber == 0){
+		struct fs_inode inode;
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		if(!writableinode(inumber)){
+			return 0;
+		}
+		if(superblock.flags & (FS_FLAG_COMPRESS | FS_FLAG_DEDUP)){
+			loadinode(inumber, &inode);
+			return fs_write(inumber, data, length, inode.size);
+		}
+		// the blocks held for other files stay theirs
+		appendend();
+		loadinode(inumber, &inode);
+		if(!ownindirect(&inode)){
+			return 0;
+		}
+		appending.inumber = inumber;
+		appending.inode = inode;
+		appending.tail = getblock();
+		if(inode.size % BLOCK_SIZE){
+			int blocknum;
+			readblockmap(&inode, inode.size / BLOCK_SIZE, 1, &blocknum);
+			if(blocknum > 0){
+				readblock(blocknum, appending.tail->data);
 			}
-			/* Direct Blocks */
 			else{
-				currblocknum = masterinode.direct[currblock];
-				/* check for free block */
-				if(currblocknum == 0){
-					currblocknum = findfreeblock();
-					if(currblocknum != -1){
-						masterinode.direct[currblock] = currblocknum;
-					}
-				}
-				// currblocknum = masterinode.direct[currblock];
+				blankblock(appending.tail->data);
 			}
-			if(currblocknum == -1){
-				printf("Error: No Valid Block Available\n");
-				return 0;
+		}
+	}
+
+	struct fs_inode *inode = &appending.inode;
+	int written = 0, n = 1;
+	disk_plug();
+	while(written < length && n > 0){
+		if(inode->size / BLOCK_SIZE >= BLOCKS_PER_FILE){
+			break;
+		}
+		if(inode->size % BLOCK_SIZE){
+			n = appendtail(inode, data + written, length - written);
+		}
+		else{
+			n = appendrun(inode, inode->size / BLOCK_SIZE, data + written, length - written);
+		}
+		inode->size += n;
+		written += n;
+	}
+	disk_unplug();
+	return written;
+}
+
+/*
+	Changes the size of a file. Growing it leaves a hole, shrinking it releases every block
+	past the new end (and the indirect block once nothing needs it) and zeroes the rest of the
+	last block so the file reads back zeros if it grows again.
+	Returns one on success, zero otherwise.
+*/
+int fs_truncate( int inumber, int size )
+{
+	if(ismounted){
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		if(size < 0 || size > MAX_FILE_SIZE){
+			printf("Error: invalid size\n");
+			return 0;
+		}
+		if(!writableinode(inumber)){
+			return 0;
+		}
+		struct fs_inode masterinode;
+		loadinode(inumber, &masterinode);
+		// the pointers past the new end must be our own before they are released
+		if(!ownindirect(&masterinode)){
+			return 0;
+		}
+		// a run held ahead of the old end no longer follows the file
+		releasehold(inumber);
+
+		if(size < masterinode.size){
+			// compressed clusters can only be dropped whole
+			int unitsize = (superblock.flags & FS_FLAG_COMPRESS) ? CLUSTER_SIZE : BLOCK_SIZE;
+			int unitend = (size + unitsize - 1) / unitsize * unitsize;
+			if(unitend > masterinode.size){
+				unitend = masterinode.size;
+			}
+
+			/* zero the tail of the last unit we keep, unless it is a hole */
+			int tailblock;
+			readblockmap(&masterinode, size / BLOCK_SIZE, 1, &tailblock);
+			if(unitend > size && (tailblock != 0 || (superblock.flags & FS_FLAG_COMPRESS))){
+				char *zeros = getcluster();
+				memset(zeros, 0, unitend - size);
+				int zeroed;
+				if(superblock.flags & FS_FLAG_COMPRESS){
+					zeroed = writeclusters(&masterinode, zeros, unitend - size, size);
+				}
+				else{
+					zeroed = writeblocks(&masterinode, zeros, unitend - size, size);
+				}
+				putcluster(zeros);
+				if(zeroed != unitend - size){
+					saveinode(inumber, &masterinode);
+					return 0;
+				}
 			}
 
-			/* Reading Data */
-			// printf("reading data\n");
-			union fs_block bufferBlock;
-			int bufferLength = DISK_BLOCK_SIZE - curroffset;
-			int lengthToCopy;
-			if(bytesleft > bufferLength){
-				lengthToCopy = bufferLength;
+			/* release everything past it */
+			int firstfree = (size + unitsize - 1) / unitsize * (unitsize / BLOCK_SIZE);
+			int *map = getmap();
+			int currblock;
+			readblockmap(&masterinode, firstfree, BLOCKS_PER_FILE - firstfree, map);
+			discardbegin();
+			for(currblock = 0; currblock < BLOCKS_PER_FILE - firstfree; currblock++){
+				freeblock(map[currblock]);
+				map[currblock] = 0;
+			}
+			if(firstfree <= POINTERS_PER_INODE && masterinode.indirect > 0){
+				for(currblock = firstfree; currblock < POINTERS_PER_INODE; currblock++){
+					masterinode.direct[currblock] = 0;
+				}
+				freeblock(masterinode.indirect);
+				masterinode.indirect = 0;
 			}
 			else{
-				lengthToCopy = bytesleft;
+				writeblockmap(&masterinode, firstfree, BLOCKS_PER_FILE - firstfree, map);
+			}
+			putmap(map);
+		}
+
+		masterinode.size = size;
+		saveinode(inumber, &masterinode);
+		discardend();
+		return 1;
+	}
+	else{
+		printf("Error: disk not mounted\n");
+	}
+	return 0;
+}
+
+/*
+	Fills the holes among logical blocks first .. first+count-1 of the inode with zeroed blocks,
+	map and newblocks being room for its block map. Returns one once the inode needs saving,
+	-1 if there were no holes, zero if the disk is full.
+*/
+int fallocateblocks(struct fs_inode *inode, int first, int count, int *map, int *newblocks){
+	int needed = 0;
+	int currblock;
+	readblockmap(inode, first, count, map);
+	for(currblock = 0; currblock < count; currblock++){
+		if(map[currblock] == 0){
+			needed++;
+		}
+	}
+	if(needed == 0){
+		return -1;
+	}
+
+	/* take one run if we can, otherwise whatever is free */
+	int run = findfreerun(needed);
+	int allocated;
+	for(allocated = 0; allocated < needed; allocated++){
+		newblocks[allocated] = run != -1 ? run + allocated : allocblock(allocated > 0 ? newblocks[allocated-1] + 1 : blockgoal(inode, first), 1);
+		if(newblocks[allocated] == -1){
+			break;
+		}
+	}
+	if(allocated < needed){
+		for(currblock = 0; currblock < allocated; currblock++){
+			freeblock(newblocks[currblock]);
+		}
+		printf("Error: No Valid Block Available\n");
+		return 0;
+	}
+
+	/* zero them before they become part of the file, plugged so a run goes out in large writes */
+	union fs_block *zeroBlock = getblock();
+	blankblock(zeroBlock->data);
+	disk_plug();
+	for(currblock = 0; currblock < needed; currblock++){
+		writeblock(newblocks[currblock], zeroBlock->data);
+	}
+	disk_unplug();
+	putblock(zeroBlock);
+
+	allocated = 0;
+	for(currblock = 0; currblock < count; currblock++){
+		if(map[currblock] == 0){
+			map[currblock] = newblocks[allocated++];
+		}
+	}
+	if(!ownindirect(inode) || !writeblockmap(inode, first, count, map)){
+		for(currblock = 0; currblock < needed; currblock++){
+			freeblock(newblocks[currblock]);
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/*
+	Reserves blocks for every hole between offset and offset+length, as one contiguous run
+	when the disk has one. The blocks are zeroed and the file size is left alone, so later
+	writes into the range, including appends, find their blocks already allocated.
+	Returns one on success, zero otherwise.
+*/
+int fs_fallocate( int inumber, int offset, int length )
+{
+	if(ismounted){
+		if(!(checkinode(inumber))){
+			printf("Error: invalid inumber\n");
+			return 0;
+		}
+		if(superblock.flags & (FS_FLAG_COMPRESS | FS_FLAG_DEDUP)){
+			printf("Error: fallocate needs a filesystem without compress or dedup\n");
+			return 0;
+		}
+		if(offset < 0 || length <= 0 || offset >= MAX_FILE_SIZE || length > MAX_FILE_SIZE - offset){
+			printf("Error: invalid range\n");
+			return 0;
+		}
+		if(!writableinode(inumber)){
+			return 0;
+		}
+		struct fs_inode masterinode;
+		loadinode(inumber, &masterinode);
+
+		int first = offset / BLOCK_SIZE;
+		int count = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+		int *map = getmap();
+		int *newblocks = getmap();
+		int result = fallocateblocks(&masterinode, first, count, map, newblocks);
+		putmap(newblocks);
+		putmap(map);
+		if(result <= 0){
+			return result == -1;
+		}
+		saveinode(inumber, &masterinode);
+		return 1;
+	}
+	else{
+		printf("Error: disk not mounted\n");
+	}
+	return 0;
+}
+
+/*
+	Online defragmenter. A file whose data blocks are not one physical run is copied into a free
+	run, found first fit, so files also drift towards the front and free space gathers behind
+	them. The copies are written first, then the indirect block and the inode, and the old blocks
+	are released last, so a crash leaves every pointer at a complete copy of the data.
+	Blocks shared through dedup or snapshots stay put, moving them would unshare them.
+*/
+#define DEFRAG_CHUNK (MAX_CLUSTER_SIZE / BLOCK_SIZE) // blocks copied per transfer, a cluster buffer's worth
+
+/* Counts the runs of free data blocks and the longest of them. */
+void freeextents(int *count, int *longest){
+	int run = 0, i;
+	*count = *longest = 0;
+	for(i = superblock.ninodeblocks + 1; i <= superblock.nblocks; i++){
+		if(i < superblock.nblocks && freeblockbitmap[i] == 0){
+			run++;
+			continue;
+		}
+		if(run > 0){
+			(*count)++;
+			if(run > *longest){
+				*longest = run;
+			}
+		}
+		run = 0;
+	}
+}
+
+/* Prints the fragmentation of the whole disk, counted the way fs_debug's summary counts it. */
+void defragreport(const char *when){
+	struct debugstats stats;
+	union fs_block *block = getblock();
+	int currblock, currinode, freeruns, longest;
+	memset(&stats, 0, sizeof(stats));
+	for(currblock = 1; currblock <= superblock.ninodeblocks; currblock++){
+		readblock(currblock, block->data);
+		for(currinode = (currblock == 1); currinode < INODES_PER_BLOCK; currinode++){
+			if(inodeused(&block->inode[currinode])){
+				debuginode((currblock-1)*INODES_PER_BLOCK + currinode, &block->inode[currinode], FS_DEBUG_SUMMARY, stats.files, &stats);
 			}
-			if(strlen(data) + lengthToCopy == length){
-				lengthToCopy-=1;
+		}
+	}
+	putblock(block);
+	freeextents(&freeruns, &longest);
+	printf("%s: %d files, %d fragmented, %.2f extents per file, free space in %d runs, longest %d blocks\n",
+		when, stats.files, stats.fragmentedfiles, stats.files ? (double)stats.extents / stats.files : 0, freeruns, longest);
+}
+
+/* Returns one if some snapshot still shares live inode block blocknum. */
+int snapshotshares(int blocknum){
+	int i;
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		if(snapshotused(&superblock.snapshots[i]) && snapmaps[i][blocknum-1] == 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Moves the data blocks of inode inumber into one run, with map and old as room for its block
+	map. Returns the number of blocks moved, zero if the file is left where it is, or -1 if it
+	needs more than budget blocks.
+*/
+int defragblocks(int inumber, struct fs_inode *inode, int budget, int report, int *map, int *old){
+	int nblocks = 0, runs = 0, first, i, j;
+
+	if(snapshotshares(inumber/INODES_PER_BLOCK + 1) || (inode->indirect > 0 && freeblockbitmap[inode->indirect] > 1)){
+		return 0;
+	}
+	readblockmap(inode, 0, BLOCKS_PER_FILE, map);
+	for(i = 0; i < BLOCKS_PER_FILE; i++){
+		if(map[i] <= 0){
+			continue;
+		}
+		if(freeblockbitmap[map[i]] > 1){
+			return 0;
+		}
+		// holes do not matter, only whether the blocks follow each other on disk
+		if(nblocks == 0 || map[i] != old[nblocks-1] + 1){
+			runs++;
+		}
+		old[nblocks++] = map[i];
+	}
+	if(runs <= 1){
+		return 0;
+	}
+	if(nblocks > budget){
+		return -1;
+	}
+	first = findfreerun(nblocks);
+	if(first == -1){
+		return 0;
+	}
+
+	char *buffer = getcluster();
+	for(i = 0; i < nblocks; i += DEFRAG_CHUNK){
+		int count = nblocks - i < DEFRAG_CHUNK ? nblocks - i : DEFRAG_CHUNK;
+		// gather the chunk a physical run at a time
+		for(j = i; j < i + count;){
+			int runlength = 1;
+			while(j + runlength < i + count && old[j + runlength] == old[j] + runlength){
+				runlength++;
 			}
-			// printf("before diskread\n");
-			disk_read(currblocknum, bufferBlock.data);
-			// printf("lengthToCopy: %d\n", lengthToCopy);
-			strncpy(bufferBlock.data + curroffset, data, lengthToCopy);
-			data+=lengthToCopy;
-			// printf("Currblocknum: %d\n", currblocknum);
-			disk_write(currblocknum, bufferBlock.data);
+			readblockrun(old[j], runlength, buffer + (long)(j - i)*BLOCK_SIZE);
+			j += runlength;
+		}
+		writeblockrun(first + i, count, buffer);
+	}
+	putcluster(buffer);
+
+	for(i = 0, j = 0; i < BLOCKS_PER_FILE; i++){
+		if(map[i] > 0){
+			map[i] = first + j++;
+		}
+	}
+	if(!writeblockmap(inode, 0, BLOCKS_PER_FILE, map)){
+		for(i = 0; i < nblocks; i++){
+			freeblock(first + i);
+		}
+		return 0;
+	}
+	saveinode(inumber, inode);
+
+	for(i = 0; i < nblocks; i++){
+		if(superblock.flags & FS_FLAG_DEDUP){
+			dedupinsert(first + i, blockhash[old[i]]);
+		}
+		freeblock(old[i]);
+	}
+	if(report){
+		printf("inode %d: %d extents moved to blocks %d-%d\n", inumber, runs, first, first + nblocks - 1);
+	}
+	return nblocks;
+}
+
+/* defragblocks with its map buffers from the pool. */
+int defragfile(int inumber, struct fs_inode *inode, int budget, int report){
+	int *map = getmap();
+	int *old = getmap();
+	int moved = defragblocks(inumber, inode, budget, report, map, old);
+	putmap(old);
+	putmap(map);
+	return moved;
+}
+
+/*
+	Defragments file opts->inumber, or every file starting where the last call stopped, until
+	opts->budget blocks have been moved, each costing one read and one write. A file bigger
+	than the whole budget is still moved when it comes first, so every file gets its turn.
+	FS_DEFRAG_REPORT prints each file moved and the disk's fragmentation before and after.
+	Returns the number of blocks moved, zero once a whole pass finds nothing to move, or -1 on error.
+*/
+int fs_defrag( const struct fs_defrag_options *opts )
+{
+	if(!ismounted){
+		printf("Error: disk not mounted\n");
+		return -1;
+	}
+	if(readonlymount()){
+		return -1;
+	}
+	appendflush();
+	int budget = opts && opts->budget > 0 ? opts->budget : INT_MAX;
+	int report = opts && (opts->flags & FS_DEFRAG_REPORT);
+	int only = opts ? opts->inumber : 0;
+	int moved = 0, result;
+	union fs_block *block;
+	struct fs_inode inode;
+
+	needrefcounts();
+	if(report){
+		defragreport("before");
+	}
 
-			// printf("after strncat\n");
-			if(lengthToCopy < bufferLength){
-				bytesleft = 0;
+	if(only > 0){
+		if(!checkinode(only)){
+			printf("Error: invalid inumber\n");
+			return -1;
+		}
+		loadinode(only, &inode);
+		result = defragfile(only, &inode, budget, report);
+		moved = result > 0 ? result : 0;
+	}
+	else{
+		int loaded = 0, visited;
+		block = getblock();
+		for(visited = 0; visited < superblock.ninodes - 1 && moved < budget; visited++){
+			if(defragcursor <= 0 || defragcursor >= superblock.ninodes){
+				defragcursor = 1;
 			}
-			else{
-				bytesleft = bytesleft - bufferLength;
+			int inumber = defragcursor;
+			if(loaded != inumber/INODES_PER_BLOCK + 1){
+				loaded = inumber/INODES_PER_BLOCK + 1;
+				readblock(loaded, block->data);
+			}
+			if(inodeused(&block->inode[inumber%INODES_PER_BLOCK])){
+				result = defragfile(inumber, &block->inode[inumber%INODES_PER_BLOCK], moved == 0 ? INT_MAX : budget - moved, report);
+				// carried on from this file next time
+				if(result < 0){
+					break;
+				}
+				moved += result;
+			}
+			defragcursor = inumber + 1;
+		}
+		putblock(block);
+	}
+
+	if(report){
+		defragreport("after");
+	}
+	return moved;
+}
+
+/* Slot of the snapshot called name in the superblock, or -1. */
+int findsnapshot(struct fs_superblock *super, const char *name){
+	int i;
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		if(snapshotused(&super->snapshots[i]) && !strcmp(super->snapshots[i].name, name)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+	Takes a snapshot of the live filesystem called name. Only the superblock is written, each
+	inode block is copied out the first time it changes afterwards, and data blocks the first
+	time they are written through a copied inode.
+	Returns one on success, zero otherwise.
+*/
+int fs_snapshot_create( const char *name )
+{
+	if(ismounted){
+		if(readonlymount()){
+			return 0;
+		}
+		appendflush();
+		if(strlen(name) == 0 || strlen(name) >= FS_SNAPSHOT_NAME){
+			printf("Error: snapshot names are 1 to %d characters\n", FS_SNAPSHOT_NAME-1);
+			return 0;
+		}
+		if(findsnapshot(&superblock, name) != -1){
+			printf("Error: snapshot %s already exists\n", name);
+			return 0;
+		}
+		int slot;
+		for(slot = 0; slot < FS_SNAPSHOT_MAX; slot++){
+			if(!snapshotused(&superblock.snapshots[slot])){
+				break;
 			}
-			// printf("past getting bytesleft\n");
+		}
+		if(slot == FS_SNAPSHOT_MAX){
+			printf("Error: no free snapshot slots\n");
+			return 0;
+		}
+		// one block has to list every map block
+		if(snapmapblocks(superblock.ninodeblocks) > POINTERS_PER_BLOCK){
+			printf("Error: the inode table is too large for snapshots\n");
+			return 0;
+		}
+
+		superblock.snapshots[slot].mapblock = 0;
+		superblock.snapshots[slot].created = time(0);
+		strcpy(superblock.snapshots[slot].name, name);
+		loadsnapmap(slot);
+		savesuperblock();
+		return 1;
+	}
+	else{
+		printf("Error: disk not mounted\n");
+	}
+	return 0;
+}
 
-			curroffset = 0;
-			currblock+=1;
+/* Deletes snapshot name, releasing every block only it still refers to. Returns one on success, zero otherwise. */
+int fs_snapshot_delete( const char *name )
+{
+	if(ismounted){
+		if(readonlymount()){
+			return 0;
+		}
+		needrefcounts();
+		appendflush();
+		int slot = findsnapshot(&superblock, name);
+		if(slot == -1){
+			printf("Error: no snapshot called %s\n", name);
+			return 0;
+		}
+		int currblock;
+		discardbegin();
+		for(currblock = 1; currblock <= superblock.ninodeblocks; currblock++){
+			if(snapmaps[slot][currblock-1] != 0){
+				dropinodeblock(snapmaps[slot][currblock-1], currblock == 1);
+			}
 		}
-		// end of loop should be here
-		masterinode.size += length - bytesleft;
-		disk_read(inodeblock, tempBlock.data);
-		// printf("Disk read done\n");
-		memcpy(&tempBlock.inode[inodenum], &masterinode, sizeof(struct fs_inode));
-		disk_write(inodeblock, tempBlock.data);
-		return length - bytesleft;
+		if(superblock.snapshots[slot].mapblock != 0){
+			for(currblock = 0; currblock < snapmapblocks(superblock.ninodeblocks); currblock++){
+				if(snapindexes[slot][currblock] != 0){
+					freeblock(snapindexes[slot][currblock]);
+				}
+			}
+			freeblock(superblock.snapshots[slot].mapblock);
+		}
+		free(snapmaps[slot]);
+		free(snapindexes[slot]);
+		snapmaps[slot] = 0;
+		snapindexes[slot] = 0;
+		memset(&superblock.snapshots[slot], 0, sizeof(struct fs_snapshot));
+		savesuperblock();
+		discardend();
+		return 1;
 	}
 	else{
-		printf("Error Disk not Mounted\n");
+		printf("Error: disk not mounted\n");
 	}
 	return 0;
 }
+
+/* Prints every snapshot with the number of inode blocks it no longer shares with the live filesystem. */
+void fs_snapshot_list()
+{
+	union fs_block *block = getblock();
+	struct fs_superblock super;
+	int i;
+
+	disk_read(0, block->data);
+	super = block->super;
+	putblock(block);
+	if(super.magic != FS_MAGIC){
+		printf("Error: no filesystem\n");
+		return;
+	}
+	for(i = 0; i < FS_SNAPSHOT_MAX; i++){
+		struct fs_snapshot *snap = &super.snapshots[i];
+		if(!snapshotused(snap)){
+			continue;
+		}
+		time_t created = snap->created;
+		char when[64];
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+		printf("%s\t%s", snap->name, when);
+		if(ismounted && snapmaps[i]){
+			int copied = 0, currblock;
+			for(currblock = 1; currblock <= superblock.ninodeblocks; currblock++){
+				copied += snapmaps[i][currblock-1] != 0;
+			}
+			printf("\t%d of %d inode blocks copied", copied, superblock.ninodeblocks);
+		}
+		if(i == mountedsnapshot){
+			printf("\t(mounted)");
+		}
+		printf("\n");
+	}
+}
+
+/* Mounts snapshot name read-only in place of the live filesystem. Returns one on success, zero otherwise. */
+int fs_mount_snapshot( const char *name )
+{
+	union fs_block *block = getblock();
+	struct fs_superblock super;
+	int slot;
+
+	disk_read(0, block->data);
+	super = block->super;
+	putblock(block);
+	if(super.magic != FS_MAGIC){
+		printf("Error: no filesystem\n");
+		return 0;
+	}
+	slot = findsnapshot(&super, name);
+	if(slot == -1){
+		printf("Error: no snapshot called %s\n", name);
+		return 0;
+	}
+	return mountfs(slot, 0);
+}
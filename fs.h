@@ -1,15 +1,82 @@
 #ifndef FS_H
 #define FS_H
 
+#define FS_FORMAT_COMPRESS 1 // store file data in compressed clusters
+#define FS_FORMAT_DEDUP    2 // share identical data blocks between files
+#define FS_FORMAT_DISCARD  4 // punch the disk's old contents out of the image instead of writing zeros
+
+#define FS_SNAPSHOT_MAX    16 // snapshots a filesystem can hold at once
+#define FS_SNAPSHOT_NAME   28 // longest snapshot name, including the terminator
+
+#define FS_MOUNT_LAZY       1 // return once the superblock checks out, the first change builds the reference counts
+#define FS_MOUNT_BACKGROUND 2 // like FS_MOUNT_LAZY, but build them on a background thread right away
+#define FS_MOUNT_READONLY   4 // map the image and refuse changes, fs_read and fs_getsize may then run on many threads at once
+
+#define FS_ALLOC_FIRSTFIT   0 // lowest free block
+#define FS_ALLOC_GOAL       1 // the block after the file's previous one, else the nearest free one after it
+#define FS_ALLOC_RESERVE    2 // like FS_ALLOC_GOAL, holding a window of blocks for each file being written
+
+#define FS_CREATE_DIR       1 // the inode holds a directory, see fs_isdir
+
+#define FS_DEBUG_JSON       1 // one JSON object instead of text
+#define FS_DEBUG_SUMMARY    2 // totals only, no per-inode listing
+
+struct fs_debug_options {
+	int flags; // FS_DEBUG_* bits
+	int inumber; // report only this inode, 0 for all of them
+};
+
+#define FS_CHECK_REPAIR     1 // fix what the check finds, only on an unmounted disk
+
+struct fs_check_options {
+	int flags; // FS_CHECK_* bits
+	int nthreads; // threads sharing the work, 0 for one per processor
+};
+
+#define FS_DEFRAG_REPORT    1 // print each file moved and the disk's fragmentation before and after
+
+struct fs_defrag_options {
+	int flags; // FS_DEFRAG_* bits
+	int inumber; // defragment only this file, 0 for all of them
+	int budget; // blocks to move before returning, 0 for no limit
+};
+
+#define FS_MAX_BLOCK_SIZE  65536 // largest block size, the smallest is DISK_BLOCK_SIZE
+
+struct fs_format_options {
+	int flags; // FS_FORMAT_* bits
+	int blocksize; // bytes per block, a power of two up to FS_MAX_BLOCK_SIZE, 0 for DISK_BLOCK_SIZE
+	int inoderatio; // bytes of disk per inode, 0 to give ten percent of the blocks to inodes
+	int ninodes; // inodes to make room for, overrides inoderatio when above 0
+};
+
 void fs_debug();
+void fs_debug_with( const struct fs_debug_options *opts );
+int  fs_check( const struct fs_check_options *opts );
 int  fs_format();
+int  fs_format_with( const struct fs_format_options *opts );
 int  fs_mount();
+int  fs_mount_with( int flags );
+int  fs_unmount();
+int  fs_alloc_policy( int policy );
 
 int  fs_create();
+int  fs_create_with( int flags );
+int  fs_isdir( int inumber );
 int  fs_delete( int inumber );
 int  fs_getsize();
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_append( int inumber, const char *data, int length );
+
+int  fs_truncate( int inumber, int size );
+int  fs_fallocate( int inumber, int offset, int length );
+int  fs_defrag( const struct fs_defrag_options *opts );
+
+int  fs_snapshot_create( const char *name );
+int  fs_snapshot_delete( const char *name );
+void fs_snapshot_list();
+int  fs_mount_snapshot( const char *name );
 
 #endif
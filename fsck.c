@@ -0,0 +1,49 @@
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+	Checks a disk image without mounting it. Exit status follows the usual fsck
+	convention: 0 clean or fully repaired, 4 problems left, 8 no filesystem or
+	the image could not be opened.
+*/
+
+int main( int argc, char *argv[] )
+{
+	struct fs_check_options opts;
+	int opt, result;
+
+	memset(&opts,0,sizeof(opts));
+
+	while((opt=getopt(argc,argv,"rj:"))!=-1) {
+		switch(opt) {
+			case 'r': opts.flags |= FS_CHECK_REPAIR; break;
+			case 'j': opts.nthreads = atoi(optarg); break;
+			default: optind = argc+1; break;
+		}
+	}
+
+	if(argc-optind!=2) {
+		printf("use: %s [-r] [-j threads] <diskfile> <nblocks>\n",argv[0]);
+		printf("    -r repairs what the check finds, -j sets the threads, one per processor by default\n");
+		return 8;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]))) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 8;
+	}
+
+	result = fs_check(&opts);
+	disk_close();
+
+	if(result<0) return 8;
+	if(result>0) return 4;
+	return 0;
+}
@@ -0,0 +1,380 @@
+
+#define _GNU_SOURCE
+
+#include "fsclient.h"
+#include "fsproto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct fsclient_pending {
+	uint32_t id;
+	int op;
+	char *data;
+	int length;
+};
+
+struct fsclient {
+	int fd;
+	uint32_t nextid;
+	int head;
+	int count;
+	struct fsclient_pending pending[FSCLIENT_MAX_INFLIGHT];
+	char *out;
+	int outlen;
+	int outcap;
+};
+
+static int fsclient_dial( const char *path )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path)>=sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if(fd<0) return -1;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+
+	if(connect(fd,(struct sockaddr*)&addr,sizeof(addr))<0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct fsclient * fsclient_connect( const char *path )
+{
+	struct fsclient *c = calloc(1,sizeof(*c));
+	if(!c) return 0;
+
+	c->fd = fsclient_dial(path);
+	if(c->fd<0) {
+		free(c);
+		return 0;
+	}
+
+	return c;
+}
+
+void fsclient_close( struct fsclient *c )
+{
+	if(c) {
+		close(c->fd);
+		free(c->out);
+		free(c);
+	}
+}
+
+static int fsclient_append( struct fsclient *c, const void *data, int length )
+{
+	if(c->outlen+length>c->outcap) {
+		int cap = c->outcap ? c->outcap : 65536;
+		char *out;
+		while(cap<c->outlen+length) cap *= 2;
+		out = realloc(c->out,cap);
+		if(!out) return 0;
+		c->out = out;
+		c->outcap = cap;
+	}
+	memcpy(c->out+c->outlen,data,length);
+	c->outlen += length;
+	return 1;
+}
+
+static int fsclient_flush( struct fsclient *c )
+{
+	int sent = 0;
+	while(sent<c->outlen) {
+		int result = write(c->fd,c->out+sent,c->outlen-sent);
+		if(result<0) {
+			if(errno==EINTR) continue;
+			return 0;
+		}
+		sent += result;
+	}
+	c->outlen = 0;
+	return 1;
+}
+
+static int fsclient_readfull( int fd, char *data, int length )
+{
+	while(length>0) {
+		int result = read(fd,data,length);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) return 0;
+		data += result;
+		length -= result;
+	}
+	return 1;
+}
+
+int fsclient_submit( struct fsclient *c, int op, int inumber, char *data, int length, int offset )
+{
+	struct fsproto_request request;
+	struct fsclient_pending *p;
+
+	if(c->count==FSCLIENT_MAX_INFLIGHT) return -1;
+	if(length<0 || length>FSPROTO_MAX_DATA) return -1;
+
+	request.id = c->nextid++;
+	request.op = op;
+	request.inumber = inumber;
+	request.offset = offset;
+	request.length = length;
+
+	if(!fsclient_append(c,&request,sizeof(request))) return -1;
+	if(op==FSPROTO_WRITE && !fsclient_append(c,data,length)) return -1;
+
+	p = &c->pending[(c->head+c->count)%FSCLIENT_MAX_INFLIGHT];
+	p->id = request.id;
+	p->op = op;
+	p->data = data;
+	p->length = length;
+	c->count++;
+
+	return request.id & 0x7fffffff;
+}
+
+int fsclient_complete( struct fsclient *c, int *result )
+{
+	struct fsproto_response response;
+	struct fsclient_pending *p;
+
+	if(c->count==0) return -1;
+	if(!fsclient_flush(c)) return -1;
+	if(!fsclient_readfull(c->fd,(char*)&response,sizeof(response))) return -1;
+
+	// the server answers in order, so this is always the oldest request
+	p = &c->pending[c->head];
+	if(response.id!=p->id || response.length>p->length) return -1;
+
+	if(response.length>0 && !fsclient_readfull(c->fd,p->data,response.length)) return -1;
+
+	c->head = (c->head+1)%FSCLIENT_MAX_INFLIGHT;
+	c->count--;
+
+	*result = response.result;
+	return response.id & 0x7fffffff;
+}
+
+int fsclient_inflight( struct fsclient *c )
+{
+	return c->count;
+}
+
+static int fsclient_call( struct fsclient *c, int op, int inumber, char *data, int length, int offset )
+{
+	int result;
+
+	// finish anything already outstanding so our answer is the next one
+	while(c->count>0) {
+		if(fsclient_complete(c,&result)<0) return -1;
+	}
+
+	if(fsclient_submit(c,op,inumber,data,length,offset)<0) return -1;
+	if(fsclient_complete(c,&result)<0) return -1;
+	return result;
+}
+
+int fsclient_create( struct fsclient *c )
+{
+	return fsclient_call(c,FSPROTO_CREATE,0,0,0,0);
+}
+
+int fsclient_delete( struct fsclient *c, int inumber )
+{
+	return fsclient_call(c,FSPROTO_DELETE,inumber,0,0,0);
+}
+
+int fsclient_getsize( struct fsclient *c, int inumber )
+{
+	return fsclient_call(c,FSPROTO_GETSIZE,inumber,0,0,0);
+}
+
+int fsclient_read( struct fsclient *c, int inumber, char *data, int length, int offset )
+{
+	return fsclient_call(c,FSPROTO_READ,inumber,data,length,offset);
+}
+
+int fsclient_write( struct fsclient *c, int inumber, const char *data, int length, int offset )
+{
+	return fsclient_call(c,FSPROTO_WRITE,inumber,(char*)data,length,offset);
+}
+
+int fsclient_truncate( struct fsclient *c, int inumber, int size )
+{
+	return fsclient_call(c,FSPROTO_TRUNCATE,inumber,0,0,size);
+}
+
+int fsclient_fallocate( struct fsclient *c, int inumber, int offset, int length )
+{
+	return fsclient_call(c,FSPROTO_FALLOCATE,inumber,0,length,offset);
+}
+
+struct fsshm {
+	int fd;
+	struct fsshm_header *h;
+	long size;
+	uint32_t nextid;
+	uint32_t sqtail;
+	uint32_t cqhead;
+	int inflight;
+};
+
+struct fsshm * fsshm_attach( const char *path, int entries, int arenasize )
+{
+	struct fsproto_request request;
+	struct fsproto_response response;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct fsshm *s;
+	int memfd;
+
+	if(entries<=0 || (entries&(entries-1)) || arenasize<0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	s = calloc(1,sizeof(*s));
+	if(!s) return 0;
+	s->size = fsshm_size(entries,arenasize);
+
+	s->fd = fsclient_dial(path);
+	if(s->fd<0) {
+		free(s);
+		return 0;
+	}
+
+	memfd = memfd_create("fsshm",MFD_CLOEXEC);
+	if(memfd<0 || ftruncate(memfd,s->size)<0) goto fail;
+
+	s->h = mmap(0,s->size,PROT_READ|PROT_WRITE,MAP_SHARED,memfd,0);
+	if(s->h==MAP_FAILED) {
+		s->h = 0;
+		goto fail;
+	}
+	s->h->magic = FSSHM_MAGIC;
+	s->h->entries = entries;
+	s->h->arenasize = arenasize;
+
+	/* hand the segment to the server along with the attach request */
+	memset(&request,0,sizeof(request));
+	request.op = FSPROTO_ATTACH;
+	request.length = s->size;
+
+	iov.iov_base = &request;
+	iov.iov_len = sizeof(request);
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg),&memfd,sizeof(int));
+
+	if(sendmsg(s->fd,&msg,0)!=sizeof(request)) goto fail;
+	if(!fsclient_readfull(s->fd,(char*)&response,sizeof(response)) || response.result!=1) goto fail;
+
+	close(memfd);
+	return s;
+
+	fail:
+	if(memfd>=0) close(memfd);
+	fsshm_detach(s);
+	return 0;
+}
+
+void fsshm_detach( struct fsshm *s )
+{
+	if(s) {
+		close(s->fd);
+		if(s->h) munmap(s->h,s->size);
+		free(s);
+	}
+}
+
+char * fsshm_arena( struct fsshm *s )
+{
+	return fsshm_data(s->h);
+}
+
+int fsshm_submit( struct fsshm *s, int op, int inumber, int dataoffset, int length, int offset )
+{
+	struct fsshm_sqe *sqe;
+
+	if(s->inflight==s->h->entries) return -1;
+	if(length<0 || length>FSPROTO_MAX_DATA) return -1;
+	if(op==FSPROTO_READ || op==FSPROTO_WRITE) {
+		if(dataoffset<0 || dataoffset+length>s->h->arenasize) return -1;
+	}
+
+	sqe = &fsshm_sq(s->h)[s->sqtail&(s->h->entries-1)];
+	sqe->id = s->nextid++;
+	sqe->op = op;
+	sqe->inumber = inumber;
+	sqe->offset = offset;
+	sqe->length = length;
+	sqe->dataoffset = dataoffset;
+
+	// publishing the tail hands the entry over to the server
+	atomic_store_explicit(&s->h->sqtail,++s->sqtail,memory_order_release);
+	s->inflight++;
+
+	return sqe->id & 0x7fffffff;
+}
+
+int fsshm_complete( struct fsshm *s, int *result )
+{
+	struct fsshm_cqe *cqe;
+	static long ncpus = 0;
+	unsigned spins = 0;
+	uint32_t id;
+
+	if(s->inflight==0) return -1;
+	if(!ncpus) ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while(atomic_load_explicit(&s->h->cqtail,memory_order_acquire)==s->cqhead) {
+		// spin first, then start yielding, and now and then make sure the server is still there
+		// spinning only helps when the server has a cpu of its own
+		if(++spins<4096 && ncpus>1) continue;
+		sched_yield();
+		if((spins&0xffff)==0) {
+			struct pollfd p = { s->fd, POLLIN, 0 };
+			if(poll(&p,1,0)>0) return -1;
+		}
+	}
+
+	cqe = &fsshm_cq(s->h)[s->cqhead&(s->h->entries-1)];
+	id = cqe->id;
+	*result = cqe->result;
+	atomic_store_explicit(&s->h->cqhead,++s->cqhead,memory_order_release);
+	s->inflight--;
+
+	return id & 0x7fffffff;
+}
+
+int fsshm_inflight( struct fsshm *s )
+{
+	return s->inflight;
+}
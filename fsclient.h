@@ -0,0 +1,51 @@
+#ifndef FSCLIENT_H
+#define FSCLIENT_H
+
+/*
+	Client side of fsserver. Each connection may have up to
+	FSCLIENT_MAX_INFLIGHT requests outstanding at once.
+*/
+
+#define FSCLIENT_MAX_INFLIGHT 256
+
+struct fsclient;
+
+struct fsclient * fsclient_connect( const char *path );
+void fsclient_close( struct fsclient *c );
+
+/*
+	Queues a request without waiting for it. For FSPROTO_WRITE data is sent,
+	for FSPROTO_READ the reply is stored there when the request completes.
+	Returns the request id, or -1 if too many requests are outstanding.
+*/
+int  fsclient_submit( struct fsclient *c, int op, int inumber, char *data, int length, int offset );
+
+/* Sends anything queued, then waits for the oldest outstanding request. Returns its id, or -1 on a lost connection. */
+int  fsclient_complete( struct fsclient *c, int *result );
+int  fsclient_inflight( struct fsclient *c );
+
+/* Blocking versions of the fs.h calls. */
+int  fsclient_create( struct fsclient *c );
+int  fsclient_delete( struct fsclient *c, int inumber );
+int  fsclient_getsize( struct fsclient *c, int inumber );
+int  fsclient_read( struct fsclient *c, int inumber, char *data, int length, int offset );
+int  fsclient_write( struct fsclient *c, int inumber, const char *data, int length, int offset );
+int  fsclient_truncate( struct fsclient *c, int inumber, int size );
+int  fsclient_fallocate( struct fsclient *c, int inumber, int offset, int length );
+
+/*
+	Shared memory connection, see fsproto.h. Requests name a range of the
+	data arena instead of a pointer; read results appear there in place.
+*/
+
+struct fsshm;
+
+struct fsshm * fsshm_attach( const char *path, int entries, int arenasize );
+void fsshm_detach( struct fsshm *s );
+
+char * fsshm_arena( struct fsshm *s );
+int  fsshm_submit( struct fsshm *s, int op, int inumber, int dataoffset, int length, int offset );
+int  fsshm_complete( struct fsshm *s, int *result );
+int  fsshm_inflight( struct fsshm *s );
+
+#endif
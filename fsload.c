@@ -0,0 +1,260 @@
+
+#include "fsclient.h"
+#include "fsproto.h"
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+	Load generator for fsserver. Each client thread gets its own connection and file,
+	then keeps depth requests in flight against random offsets until time runs out.
+	The socket and shm modes talk to a running server, the direct mode links the
+	filesystem in and mounts the image itself, as a baseline for transport overhead.
+*/
+
+#define MODE_SOCKET 0
+#define MODE_SHM    1
+#define MODE_DIRECT 2
+
+#define SETUP_CHUNK 65536
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct fsclient *client;
+	struct fsshm *shm;
+	char *buffers; // depth slots of iosize bytes, then a setup chunk
+	int results[FSCLIENT_MAX_INFLIGHT]; // direct mode runs at submit and queues results here
+	int ids[FSCLIENT_MAX_INFLIGHT];
+	int head, count, nextid;
+	long long ops;
+	double latency;
+	int failed;
+};
+
+static const char *target;
+static int mode = MODE_SOCKET;
+static int nclients = 4;
+static int seconds = 5;
+static int depth = 16;
+static int iosize = 512;
+static int writepct = 0;
+static int filesize = 1<<20;
+
+static pthread_barrier_t ready;
+static double deadline;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int submit( struct worker *w, int op, int inumber, int slot, int length, int offset )
+{
+	char *data = w->buffers + (long)slot*iosize;
+	int result;
+
+	if(mode==MODE_SOCKET) return fsclient_submit(w->client,op,inumber,data,length,offset);
+	if(mode==MODE_SHM) return fsshm_submit(w->shm,op,inumber,data-w->buffers,length,offset);
+
+	switch(op) {
+		case FSPROTO_CREATE: result = fs_create(); break;
+		case FSPROTO_DELETE: result = fs_delete(inumber); break;
+		case FSPROTO_READ: result = fs_read(inumber,data,length,offset); break;
+		case FSPROTO_WRITE: result = fs_write(inumber,data,length,offset); break;
+		default: result = -1; break;
+	}
+	w->results[(w->head+w->count)%FSCLIENT_MAX_INFLIGHT] = result;
+	w->ids[(w->head+w->count)%FSCLIENT_MAX_INFLIGHT] = w->nextid;
+	w->count++;
+	return w->nextid++ & 0x7fffffff;
+}
+
+static int complete( struct worker *w, int *result )
+{
+	int id;
+
+	if(mode==MODE_SOCKET) return fsclient_complete(w->client,result);
+	if(mode==MODE_SHM) return fsshm_complete(w->shm,result);
+
+	if(w->count==0) return -1;
+	*result = w->results[w->head];
+	id = w->ids[w->head];
+	w->head = (w->head+1)%FSCLIENT_MAX_INFLIGHT;
+	w->count--;
+	return id;
+}
+
+static int inflight( struct worker *w )
+{
+	if(mode==MODE_SOCKET) return fsclient_inflight(w->client);
+	if(mode==MODE_SHM) return fsshm_inflight(w->shm);
+	return w->count;
+}
+
+// submits one request and waits for it, slot is a buffer index as for submit
+static int call( struct worker *w, int op, int inumber, int slot, int length, int offset )
+{
+	int result;
+	if(submit(w,op,inumber,slot,length,offset)<0) return -1;
+	if(complete(w,&result)<0) return -1;
+	return result;
+}
+
+static void * run_worker( void *arg )
+{
+	struct worker *w = arg;
+	double started[FSCLIENT_MAX_INFLIGHT];
+	unsigned seed = w->id*7919 + 1;
+	int setupslot = depth;
+	int inumber = 0, offset, result, id, slot = 0;
+
+	if(mode==MODE_SOCKET) {
+		w->client = fsclient_connect(target);
+		w->buffers = malloc((long)depth*iosize+SETUP_CHUNK);
+		if(!w->client) w->failed = 1;
+	} else if(mode==MODE_SHM) {
+		w->shm = fsshm_attach(target,FSCLIENT_MAX_INFLIGHT,depth*iosize+SETUP_CHUNK);
+		if(w->shm) w->buffers = fsshm_arena(w->shm);
+		else w->failed = 1;
+	} else {
+		w->buffers = malloc((long)depth*iosize+SETUP_CHUNK);
+	}
+
+	if(!w->failed) {
+		// the setup chunk sits right after the depth slots, which is slot number depth
+		char *chunk = w->buffers + (long)depth*iosize;
+		memset(chunk,'a'+w->id%26,SETUP_CHUNK);
+		inumber = call(w,FSPROTO_CREATE,0,0,0,0);
+		for(offset=0;inumber>0 && offset<filesize;offset+=SETUP_CHUNK) {
+			int length = filesize-offset < SETUP_CHUNK ? filesize-offset : SETUP_CHUNK;
+			if(call(w,FSPROTO_WRITE,inumber,setupslot,length,offset)!=length) break;
+		}
+		if(inumber<=0 || offset<filesize) w->failed = 1;
+	}
+
+	pthread_barrier_wait(&ready);
+
+	while(!w->failed && now()<deadline) {
+		while(inflight(w)<depth) {
+			int op = (int)(rand_r(&seed)%100) < writepct ? FSPROTO_WRITE : FSPROTO_READ;
+			offset = rand_r(&seed) % (filesize-iosize+1);
+			id = submit(w,op,inumber,slot,iosize,offset);
+			if(id<0) break;
+			started[id%FSCLIENT_MAX_INFLIGHT] = now();
+			slot = (slot+1)%depth;
+		}
+		id = complete(w,&result);
+		if(id<0 || result!=iosize) {
+			w->failed = 1;
+			break;
+		}
+		w->latency += now()-started[id%FSCLIENT_MAX_INFLIGHT];
+		w->ops++;
+	}
+
+	while(inflight(w)>0 && complete(w,&result)>=0) {}
+	if(inumber>0) call(w,FSPROTO_DELETE,inumber,0,0,0);
+
+	if(mode==MODE_SHM) {
+		fsshm_detach(w->shm);
+	} else {
+		fsclient_close(w->client);
+		free(w->buffers);
+	}
+	return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct worker *workers;
+	const char *modename = "socket";
+	int nblocks = 0;
+	long long ops = 0;
+	double latency = 0, start, elapsed;
+	int opt, i, failed = 0;
+
+	while((opt=getopt(argc,argv,"m:n:c:t:d:s:w:f:"))!=-1) {
+		switch(opt) {
+			case 'm': modename = optarg; break;
+			case 'n': nblocks = atoi(optarg); break;
+			case 'c': nclients = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'd': depth = atoi(optarg); break;
+			case 's': iosize = atoi(optarg); break;
+			case 'w': writepct = atoi(optarg); break;
+			case 'f': filesize = atoi(optarg); break;
+			default: optind = argc+1; break;
+		}
+	}
+
+	if(!strcmp(modename,"socket")) mode = MODE_SOCKET;
+	else if(!strcmp(modename,"shm")) mode = MODE_SHM;
+	else if(!strcmp(modename,"direct")) mode = MODE_DIRECT, nclients = 1;
+	else optind = argc+1;
+
+	// the iosize check keeps the setup chunk on a slot boundary
+	if(optind!=argc-1 || nclients<1 || depth<1 || depth>FSCLIENT_MAX_INFLIGHT || iosize<1 || iosize>filesize
+	   || SETUP_CHUNK%iosize || (mode==MODE_DIRECT && (nclients!=1 || nblocks<=0))) {
+		printf("use: %s [-m socket|shm] [-c clients] [-t seconds] [-d depth] [-s iosize] [-w write%%] [-f filesize] <socket>\n",argv[0]);
+		printf("     %s -m direct -n <nblocks> [-t seconds] [-d depth] [-s iosize] [-w write%%] [-f filesize] <diskfile>\n",argv[0]);
+		printf("iosize must divide %d, and direct mode runs a single client\n",SETUP_CHUNK);
+		return 1;
+	}
+	target = argv[optind];
+
+	if(mode==MODE_DIRECT) {
+		if(!disk_init(target,nblocks) || !fs_mount()) {
+			printf("couldn't mount %s\n",target);
+			return 1;
+		}
+	}
+
+	workers = calloc(nclients,sizeof(*workers));
+	pthread_barrier_init(&ready,0,nclients+1);
+	deadline = now() + 3600;
+
+	for(i=0;i<nclients;i++) {
+		workers[i].id = i;
+		pthread_create(&workers[i].thread,0,run_worker,&workers[i]);
+	}
+
+	// the clock starts once every client has its file in place
+	pthread_barrier_wait(&ready);
+	start = now();
+	deadline = start + seconds;
+
+	for(i=0;i<nclients;i++) {
+		pthread_join(workers[i].thread,0);
+		ops += workers[i].ops;
+		latency += workers[i].latency;
+		failed += workers[i].failed;
+	}
+	elapsed = now()-start;
+
+	printf("%s: %d clients, depth %d, %d byte ops, %d%% writes\n",modename,nclients,depth,iosize,writepct);
+	printf("%lld requests in %.2f s\n",ops,elapsed);
+	printf("%.0f requests/s\n",ops/elapsed);
+	printf("%.1f MB/s\n",ops*(double)iosize/elapsed/1e6);
+	if(ops>0) {
+		printf("%.1f us average latency\n",latency/ops*1e6);
+		printf("%.3f us per request\n",elapsed*nclients/ops*1e6);
+	}
+	if(failed) printf("%d clients failed\n",failed);
+
+	if(mode==MODE_DIRECT) {
+		fs_unmount();
+		disk_close();
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+#ifndef FSPROTO_H
+#define FSPROTO_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+	Wire protocol between fsserver and fsclient.
+	A client sends a request header, followed by length bytes of data for a write.
+	The server answers every request in the order it arrived with a response header,
+	followed by length bytes of data for a read. result is what the fs.h call returned.
+	Clients may send many requests before reading any responses.
+	FSPROTO_TRUNCATE passes the new size in offset.
+*/
+
+#define FSPROTO_CREATE    1
+#define FSPROTO_DELETE    2
+#define FSPROTO_GETSIZE   3
+#define FSPROTO_READ      4
+#define FSPROTO_WRITE     5
+#define FSPROTO_TRUNCATE  6
+#define FSPROTO_FALLOCATE 7
+#define FSPROTO_ATTACH    8 // carries a shared memory segment fd, see below
+
+#define FSPROTO_MAX_DATA  (1<<20) // largest read or write in one request
+
+struct fsproto_request {
+	uint32_t id;
+	uint32_t op;
+	int32_t  inumber;
+	int32_t  offset;
+	int32_t  length;
+};
+
+struct fsproto_response {
+	uint32_t id;
+	int32_t  result;
+	uint32_t length;
+};
+
+/*
+	Shared memory transport. The client creates a segment holding a submission ring,
+	a completion ring and a data arena, and passes its fd to the server with an
+	FSPROTO_ATTACH request (length is the segment size). After that, requests go
+	through the rings instead of the socket. Each ring has one producer and one consumer.
+	Data for a request lives in the arena at dataoffset: fs_read results are written
+	straight there by the server, and fs_write takes its data from there.
+	The socket stays open so each side notices when the other goes away.
+*/
+
+#define FSSHM_MAGIC 0x66736d31 // "fsm1"
+
+struct fsshm_sqe {
+	uint32_t id;
+	uint32_t op;
+	int32_t  inumber;
+	int32_t  offset;
+	int32_t  length;
+	uint32_t dataoffset;
+};
+
+struct fsshm_cqe {
+	uint32_t id;
+	int32_t  result;
+};
+
+struct fsshm_header {
+	uint32_t magic;
+	uint32_t entries; // ring size, a power of two
+	uint32_t arenasize;
+	_Alignas(64) _Atomic uint32_t sqhead; // advanced by the server
+	_Alignas(64) _Atomic uint32_t sqtail; // advanced by the client
+	_Alignas(64) _Atomic uint32_t cqhead; // advanced by the client
+	_Alignas(64) _Atomic uint32_t cqtail; // advanced by the server
+};
+
+static inline struct fsshm_sqe * fsshm_sq( struct fsshm_header *h )
+{
+	return (struct fsshm_sqe *)(h+1);
+}
+
+static inline struct fsshm_cqe * fsshm_cq( struct fsshm_header *h )
+{
+	return (struct fsshm_cqe *)(fsshm_sq(h)+h->entries);
+}
+
+static inline char * fsshm_data( struct fsshm_header *h )
+{
+	return (char *)(fsshm_cq(h)+h->entries);
+}
+
+static inline long fsshm_size( int entries, int arenasize )
+{
+	return sizeof(struct fsshm_header) + entries*(sizeof(struct fsshm_sqe)+sizeof(struct fsshm_cqe)) + arenasize;
+}
+
+#endif
@@ -0,0 +1,449 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "fsproto.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+	Mounts a disk image once and serves the fs.h calls to local clients over a Unix socket.
+	One thread runs everything: each pass over poll reads whatever every ready client
+	has sent, runs all the complete requests in arrival order, and answers each client
+	with a single write holding all of its responses.
+	Clients on the shared memory transport are served from their rings on the same
+	thread. While any of them are busy the loop spins instead of sleeping in poll.
+	With -d the loop defragments in steps of that many blocks whenever it is idle,
+	until a pass finds nothing to move, and starts again once requests come in.
+*/
+
+#define MAX_CLIENTS 1024
+#define READ_CHUNK  262144
+#define SHM_BATCH   64    // ring entries taken from one client per pass
+#define SPIN_PASSES 20000 // idle passes before the loop goes back to sleeping
+#define DEFRAG_IDLE 50    // milliseconds without requests before a defrag step
+
+struct client {
+	int fd;
+	char *in;
+	int inlen;
+	int incap;
+	char *out;
+	int outlen;
+	int outsent;
+	int outcap;
+	int passedfd;              // fd received with the last message, -1 if none
+	struct fsshm_header *shm;  // attached segment, if any
+	long shmsize;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int nclients = 0;
+static volatile sig_atomic_t stopping = 0;
+
+static long long nrequests = 0;
+static long long nbatches = 0;
+static int nshm = 0;
+
+static void handle_stop( int sig )
+{
+	stopping = 1;
+}
+
+static int reserve( char **buffer, int *cap, int needed )
+{
+	if(needed>*cap) {
+		int newcap = *cap ? *cap : 65536;
+		char *b;
+		while(newcap<needed) newcap *= 2;
+		b = realloc(*buffer,newcap);
+		if(!b) return 0;
+		*buffer = b;
+		*cap = newcap;
+	}
+	return 1;
+}
+
+static void drop_client( int i )
+{
+	if(clients[i].shm) {
+		munmap(clients[i].shm,clients[i].shmsize);
+		nshm--;
+	}
+	if(clients[i].passedfd>=0) close(clients[i].passedfd);
+	close(clients[i].fd);
+	free(clients[i].in);
+	free(clients[i].out);
+	clients[i] = clients[--nclients];
+}
+
+// runs one fs.h call, for a read data is where the result goes
+static int run_op( int op, int inumber, char *data, int length, int offset )
+{
+	// offsets and lengths come from the client, a bad one is refused before fs.c sees it
+	if(op==FSPROTO_READ || op==FSPROTO_WRITE || op==FSPROTO_TRUNCATE || op==FSPROTO_FALLOCATE) {
+		if(offset<0 || length<0 || (long long)offset+length>INT_MAX) return -1;
+	}
+
+	switch(op) {
+		case FSPROTO_CREATE:
+			return fs_create();
+		case FSPROTO_DELETE:
+			return fs_delete(inumber);
+		case FSPROTO_GETSIZE:
+			return fs_getsize(inumber);
+		case FSPROTO_READ:
+			return fs_read(inumber,data,length,offset);
+		case FSPROTO_WRITE:
+			return fs_write(inumber,data,length,offset);
+		case FSPROTO_TRUNCATE:
+			return fs_truncate(inumber,offset);
+		case FSPROTO_FALLOCATE:
+			return fs_fallocate(inumber,offset,length);
+		default:
+			return -1;
+	}
+}
+
+// maps the segment that came with an attach request, returns one on success
+static int attach_client( struct client *c, long size )
+{
+	struct fsshm_header *h;
+
+	if(c->shm || c->passedfd<0 || size<(long)sizeof(*h)) return 0;
+
+	h = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,c->passedfd,0);
+	close(c->passedfd);
+	c->passedfd = -1;
+	if(h==MAP_FAILED) return 0;
+
+	if(h->magic!=FSSHM_MAGIC || h->entries==0 || (h->entries&(h->entries-1)) || h->entries>(1<<20)
+	   || fsshm_size(h->entries,h->arenasize)!=size) {
+		munmap(h,size);
+		return 0;
+	}
+
+	c->shm = h;
+	c->shmsize = size;
+	nshm++;
+	return 1;
+}
+
+// runs one request and appends its response, returns zero if the client sent garbage
+static int run_request( struct client *c, struct fsproto_request *request, char *data )
+{
+	struct fsproto_response response;
+	int datalength = 0;
+	char *reply;
+
+	if(request->length<0 || request->length>FSPROTO_MAX_DATA) {
+		if(request->op!=FSPROTO_ATTACH) return 0;
+	}
+
+	if(!reserve(&c->out,&c->outcap,c->outlen+sizeof(response)+(request->op==FSPROTO_READ ? request->length : 0))) return 0;
+	reply = c->out + c->outlen + sizeof(response);
+
+	response.id = request->id;
+	if(request->op==FSPROTO_ATTACH) {
+		response.result = attach_client(c,(unsigned)request->length);
+	} else {
+		response.result = run_op(request->op,request->inumber,request->op==FSPROTO_READ ? reply : data,request->length,request->offset);
+		if(request->op==FSPROTO_READ && response.result>0) datalength = response.result;
+	}
+	response.length = datalength;
+
+	memcpy(c->out+c->outlen,&response,sizeof(response));
+	c->outlen += sizeof(response) + datalength;
+	nrequests++;
+	return 1;
+}
+
+/*
+	Runs up to SHM_BATCH requests from a client's submission ring, writing read
+	results straight into its arena. Returns how many were run.
+*/
+static int run_shm( struct client *c )
+{
+	struct fsshm_header *h = c->shm;
+	struct fsshm_sqe *sq = fsshm_sq(h);
+	struct fsshm_cqe *cq = fsshm_cq(h);
+	uint32_t mask = h->entries-1;
+	uint32_t head = atomic_load_explicit(&h->sqhead,memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&h->sqtail,memory_order_acquire);
+	uint32_t cqtail = atomic_load_explicit(&h->cqtail,memory_order_relaxed);
+	uint32_t cqhead = atomic_load_explicit(&h->cqhead,memory_order_acquire);
+	int n = 0;
+
+	while(head!=tail && n<SHM_BATCH && cqtail-cqhead<h->entries) {
+		// take a private copy so the client cannot change it under us
+		struct fsshm_sqe sqe = sq[head&mask];
+		int result = -1;
+
+		if(sqe.length>=0 && sqe.length<=FSPROTO_MAX_DATA) {
+			if(sqe.op!=FSPROTO_READ && sqe.op!=FSPROTO_WRITE) {
+				result = run_op(sqe.op,sqe.inumber,0,sqe.length,sqe.offset);
+			} else if((uint64_t)sqe.dataoffset+sqe.length<=h->arenasize) {
+				result = run_op(sqe.op,sqe.inumber,fsshm_data(h)+sqe.dataoffset,sqe.length,sqe.offset);
+			}
+		}
+
+		cq[cqtail&mask].id = sqe.id;
+		cq[cqtail&mask].result = result;
+		cqtail++;
+		head++;
+		n++;
+	}
+
+	if(n>0) {
+		atomic_store_explicit(&h->sqhead,head,memory_order_release);
+		atomic_store_explicit(&h->cqtail,cqtail,memory_order_release);
+		nrequests += n;
+	}
+	return n;
+}
+
+// runs every complete request in the input buffer
+static int run_requests( struct client *c )
+{
+	int used = 0;
+
+	while(c->inlen-used>=sizeof(struct fsproto_request)) {
+		struct fsproto_request request;
+		int payload;
+
+		memcpy(&request,c->in+used,sizeof(request));
+		payload = request.op==FSPROTO_WRITE ? request.length : 0;
+		if(payload<0 || payload>FSPROTO_MAX_DATA) return 0;
+		if(c->inlen-used<sizeof(request)+payload) break;
+
+		if(!run_request(c,&request,c->in+used+sizeof(request))) return 0;
+		used += sizeof(request) + payload;
+	}
+
+	memmove(c->in,c->in+used,c->inlen-used);
+	c->inlen -= used;
+	return 1;
+}
+
+static int read_client( struct client *c )
+{
+	while(1) {
+		char control[CMSG_SPACE(sizeof(int))];
+		struct msghdr msg;
+		struct iovec iov;
+		struct cmsghdr *cmsg;
+		int result;
+
+		if(!reserve(&c->in,&c->incap,c->inlen+READ_CHUNK)) return 0;
+
+		iov.iov_base = c->in+c->inlen;
+		iov.iov_len = READ_CHUNK;
+		memset(&msg,0,sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		result = recvmsg(c->fd,&msg,MSG_CMSG_CLOEXEC);
+		if(result<0 && errno==EINTR) continue;
+		if(result<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return 1;
+		if(result<=0) return 0;
+
+		// an fd passed along with an attach request
+		for(cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg)) {
+			if(cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS) {
+				if(c->passedfd>=0) close(c->passedfd);
+				memcpy(&c->passedfd,CMSG_DATA(cmsg),sizeof(int));
+			}
+		}
+
+		c->inlen += result;
+		if(result<READ_CHUNK) return 1;
+	}
+}
+
+static int write_client( struct client *c )
+{
+	while(c->outsent<c->outlen) {
+		int result = write(c->fd,c->out+c->outsent,c->outlen-c->outsent);
+		if(result<0 && errno==EINTR) continue;
+		if(result<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return 1;
+		if(result<=0) return 0;
+		c->outsent += result;
+	}
+	c->outlen = c->outsent = 0;
+	return 1;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct sockaddr_un addr;
+	struct pollfd fds[MAX_CLIENTS+1];
+	struct sigaction sa;
+	struct fs_defrag_options defrag;
+	const char *diskfile, *socketpath;
+	int listenfd, i, opt;
+	int idle = 0, passes = 0;
+	int defragging = 0;
+	long long lastrequests = 0;
+
+	memset(&defrag,0,sizeof(defrag));
+	while((opt=getopt(argc,argv,"d:m:"))!=-1) {
+		switch(opt) {
+			case 'd': defrag.budget = atoi(optarg); break;
+			case 'm':
+				if(!disk_model(optarg)) {
+					printf("unknown device model %s\n",optarg);
+					return 1;
+				}
+				break;
+			default: optind = argc+1; break;
+		}
+	}
+
+	if(argc-optind!=3 || defrag.budget<0) {
+		printf("use: %s [-d blocks] [-m model] <diskfile> <nblocks> <socket>\n",argv[0]);
+		printf("    -d defragments while idle, moving at most that many blocks per step\n");
+		printf("    -m charges a device model: hdd or ssd, then ,overhead= ,seek= ,rpm= ,bw= or ,sleep\n");
+		return 1;
+	}
+	diskfile = argv[optind];
+	socketpath = argv[optind+2];
+	defragging = defrag.budget>0;
+
+	if(!disk_init(diskfile,atoi(argv[optind+1]))) {
+		printf("couldn't initialize %s: %s\n",diskfile,strerror(errno));
+		return 1;
+	}
+
+	// serve reads at once, the first change waits for the block reference counts
+	if(!fs_mount_with(FS_MOUNT_BACKGROUND)) {
+		printf("couldn't mount %s\n",diskfile);
+		return 1;
+	}
+
+	if(strlen(socketpath)>=sizeof(addr.sun_path)) {
+		printf("socket path %s is too long\n",socketpath);
+		return 1;
+	}
+
+	listenfd = socket(AF_UNIX,SOCK_STREAM,0);
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,socketpath);
+	unlink(socketpath);
+
+	if(listenfd<0 || bind(listenfd,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(listenfd,128)<0) {
+		printf("couldn't listen on %s: %s\n",socketpath,strerror(errno));
+		return 1;
+	}
+	fcntl(listenfd,F_SETFL,O_NONBLOCK);
+
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT,&sa,0);
+	sigaction(SIGTERM,&sa,0);
+	signal(SIGPIPE,SIG_IGN);
+
+	printf("serving %s on %s\n",diskfile,socketpath);
+	fflush(stdout);
+
+	while(!stopping) {
+		int timeout = -1;
+
+		/* with shared memory clients around, spin while they are busy and nap briefly when not */
+		if(nshm>0) {
+			int work = 0;
+			for(i=0;i<nclients;i++) {
+				if(clients[i].shm) work += run_shm(&clients[i]);
+			}
+			idle = work ? 0 : idle+1;
+			timeout = idle<SPIN_PASSES ? 0 : 1;
+			// hand the cpu to the clients rather than burning our slice when they share it
+			if(!work && timeout==0) sched_yield();
+			// only look at the sockets every so often while spinning
+			if(timeout==0 && (++passes&63)) continue;
+		}
+
+		fds[0].fd = listenfd;
+		fds[0].events = POLLIN;
+		for(i=0;i<nclients;i++) {
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN | (clients[i].outlen>clients[i].outsent ? POLLOUT : 0);
+		}
+
+		// anything that came in since the last step may have fragmented files again
+		if(defrag.budget>0 && nrequests!=lastrequests) {
+			lastrequests = nrequests;
+			defragging = 1;
+		}
+		if(defragging && timeout<0) timeout = DEFRAG_IDLE;
+
+		int ready = poll(fds,nclients+1,timeout);
+		if(ready<0) {
+			if(errno==EINTR) continue;
+			printf("poll failed: %s\n",strerror(errno));
+			break;
+		}
+		// only after a real wait, not while spinning for shared memory clients
+		if(ready==0 && timeout>0 && defragging) {
+			if(fs_defrag(&defrag)<=0) defragging = 0;
+			continue;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			int fd;
+			while((fd=accept(listenfd,0,0))>=0) {
+				if(nclients==MAX_CLIENTS) {
+					close(fd);
+					continue;
+				}
+				fcntl(fd,F_SETFL,O_NONBLOCK);
+				memset(&clients[nclients],0,sizeof(clients[nclients]));
+				clients[nclients].fd = fd;
+				clients[nclients].passedfd = -1;
+				nclients++;
+			}
+		}
+
+		/* gather and run everything that arrived, then answer each client once */
+		int npolled = nclients;
+		for(i=npolled-1;i>=0;i--) {
+			if(!(fds[i+1].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+			if(!read_client(&clients[i]) || !run_requests(&clients[i])) {
+				// answer what we can before letting go of a client that hung up
+				run_requests(&clients[i]);
+				write_client(&clients[i]);
+				drop_client(i);
+			}
+		}
+		for(i=nclients-1;i>=0;i--) {
+			if(clients[i].outlen>clients[i].outsent) {
+				nbatches++;
+				if(!write_client(&clients[i])) drop_client(i);
+			}
+		}
+	}
+
+	for(i=nclients-1;i>=0;i--) drop_client(i);
+	close(listenfd);
+	unlink(socketpath);
+
+	printf("%lld requests in %lld batches\n",nrequests,nbatches);
+	fs_unmount();
+	printf("closing emulated disk.\n");
+	disk_close();
+
+	return 0;
+}
@@ -0,0 +1,154 @@
+
+#include "lz.h"
+
+#include <string.h>
+
+/*
+	Stream format (LZ4-like):
+	each sequence is a token byte, high nibble = literal count, low nibble = match length - 4.
+	A nibble of 15 is followed by extension bytes added on until one is less than 255.
+	Then come the literals, then a two byte little endian match offset and the match extension.
+	The final sequence carries only literals and ends the stream.
+*/
+
+#define LZ_HASH_BITS  12
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+
+static unsigned lz_hash( const unsigned char *p )
+{
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// write the extension bytes of a length, returns the new output pointer or 0 if out of room
+static unsigned char *lz_putlen( unsigned char *op, unsigned char *oend, int len )
+{
+	while(len >= 255){
+		if(op >= oend) return 0;
+		*op++ = 255;
+		len -= 255;
+	}
+	if(op >= oend) return 0;
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *lz_putseq( unsigned char *op, unsigned char *oend, const unsigned char *lit, int litlen, int offset, int matchlen )
+{
+	unsigned char *token;
+	int mcode = matchlen - LZ_MIN_MATCH;
+
+	if(op >= oend) return 0;
+	token = op++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if(litlen >= 15 && !(op = lz_putlen(op, oend, litlen - 15))) return 0;
+
+	if(oend - op < litlen) return 0;
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	// final sequence has no match part
+	if(matchlen == 0) return op;
+
+	if(oend - op < 2) return 0;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	*token |= (mcode >= 15 ? 15 : mcode);
+	if(mcode >= 15 && !(op = lz_putlen(op, oend, mcode - 15))) return 0;
+	return op;
+}
+
+int lz_compress( const char *src, int srclen, char *dst, int dstcap )
+{
+	const unsigned char *base = (const unsigned char *)src;
+	const unsigned char *ip = base, *anchor = base;
+	const unsigned char *end = base + srclen;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + dstcap;
+	int table[1 << LZ_HASH_BITS];
+	int i;
+
+	for(i = 0; i < (1 << LZ_HASH_BITS); i++){
+		table[i] = -1;
+	}
+
+	while(end - ip >= LZ_MIN_MATCH){
+		unsigned h = lz_hash(ip);
+		int ref = table[h];
+		table[h] = ip - base;
+
+		if(ref >= 0 && (ip - base) - ref <= LZ_MAX_OFFSET && !memcmp(base + ref, ip, LZ_MIN_MATCH)){
+			const unsigned char *match = base + ref;
+			int matchlen = LZ_MIN_MATCH;
+			while(ip + matchlen < end && match[matchlen] == ip[matchlen]){
+				matchlen++;
+			}
+			op = lz_putseq(op, oend, anchor, ip - anchor, (ip - base) - ref, matchlen);
+			if(!op) return 0;
+			ip += matchlen;
+			anchor = ip;
+		}
+		else{
+			ip++;
+		}
+	}
+
+	op = lz_putseq(op, oend, anchor, end - anchor, 0, 0);
+	if(!op) return 0;
+	return op - (unsigned char *)dst;
+}
+
+int lz_decompress( const char *src, int srclen, char *dst, int dstcap )
+{
+	const unsigned char *ip = (const unsigned char *)src;
+	const unsigned char *iend = ip + srclen;
+	unsigned char *op = (unsigned char *)dst;
+	unsigned char *oend = op + dstcap;
+
+	while(ip < iend){
+		int token = *ip++;
+		int litlen = token >> 4;
+		int matchlen = token & 15;
+		int offset, b;
+
+		if(litlen == 15){
+			do {
+				if(ip >= iend) return -1;
+				b = *ip++;
+				litlen += b;
+			} while(b == 255);
+		}
+		if(iend - ip < litlen || oend - op < litlen) return -1;
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+
+		// literals only, this was the last sequence
+		if(ip >= iend) break;
+
+		if(iend - ip < 2) return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op - (unsigned char *)dst) return -1;
+
+		if(matchlen == 15){
+			do {
+				if(ip >= iend) return -1;
+				b = *ip++;
+				matchlen += b;
+			} while(b == 255);
+		}
+		matchlen += LZ_MIN_MATCH;
+		if(oend - op < matchlen) return -1;
+
+		// byte at a time since the match may overlap the output
+		while(matchlen-- > 0){
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op - (unsigned char *)dst;
+}
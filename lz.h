@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+	Small self-contained LZ77 codec used for compressed file clusters.
+	lz_compress returns the compressed length, or 0 if the output would not fit in dstcap.
+	lz_decompress returns the decompressed length, or -1 if the input is corrupt.
+*/
+
+int  lz_compress( const char *src, int srclen, char *dst, int dstcap );
+int  lz_decompress( const char *src, int srclen, char *dst, int dstcap );
+
+#endif
@@ -0,0 +1,145 @@
+
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+	Read scaling benchmark. Mounts the image read-only and runs 1, 2, 4 ... reader
+	threads, each reading the given files start to end over and over, all of them
+	through the same mount. The files are read once first so the runs measure
+	cached data, and with no locks on the read path throughput should grow with
+	the thread count until the processors run out.
+*/
+
+#define MAX_THREADS 256
+
+static int *files;
+static int *sizes;
+static int nfiles;
+static int request = 65536;
+static double deadline;
+
+struct reader {
+	pthread_t thread;
+	int first; // file this reader starts with, so they do not all move in step
+	long long bytes;
+};
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void * reader_main( void *arg )
+{
+	struct reader *r = arg;
+	char *buffer = malloc(request);
+	int i = r->first, offset;
+
+	while(now()<deadline) {
+		for(offset=0;offset<sizes[i];offset+=request) {
+			r->bytes += fs_read(files[i],buffer,request,offset);
+		}
+		i = (i+1) % nfiles;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+static double run( int nthreads, int seconds )
+{
+	struct reader readers[MAX_THREADS];
+	long long bytes = 0;
+	double start;
+	int i;
+
+	start = now();
+	deadline = start + seconds;
+	for(i=0;i<nthreads;i++) {
+		readers[i].first = i % nfiles;
+		readers[i].bytes = 0;
+		pthread_create(&readers[i].thread,0,reader_main,&readers[i]);
+	}
+	for(i=0;i<nthreads;i++) {
+		pthread_join(readers[i].thread,0);
+		bytes += readers[i].bytes;
+	}
+	return bytes / (now()-start) / 1e6;
+}
+
+int main( int argc, char *argv[] )
+{
+	int maxthreads = sysconf(_SC_NPROCESSORS_ONLN), seconds = 2;
+	int opt, i, n;
+	double single = 0, rate;
+
+	while((opt=getopt(argc,argv,"j:t:r:"))!=-1) {
+		switch(opt) {
+			case 'j': maxthreads = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 'r': request = atoi(optarg); break;
+			default: optind = argc+1; break;
+		}
+	}
+
+	if(argc-optind<3 || maxthreads<1 || maxthreads>MAX_THREADS || seconds<1 || request<1) {
+		printf("use: %s [-j threads] [-t seconds] [-r request bytes] <diskfile> <nblocks> <inode> [inode ...]\n",argv[0]);
+		printf("    -j is the most reader threads, one per processor by default\n");
+		return 1;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]))) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	if(!fs_mount_with(FS_MOUNT_READONLY)) {
+		printf("couldn't mount %s read-only\n",argv[optind]);
+		return 1;
+	}
+
+	nfiles = argc-optind-2;
+	files = malloc(nfiles*sizeof(int));
+	sizes = malloc(nfiles*sizeof(int));
+	for(i=0;i<nfiles;i++) {
+		files[i] = atoi(argv[optind+2+i]);
+		sizes[i] = fs_getsize(files[i]);
+		if(sizes[i]<=0) {
+			printf("inode %d is not a file with data\n",files[i]);
+			return 1;
+		}
+	}
+
+	// warm the page cache
+	{
+		char *buffer = malloc(request);
+		int offset;
+		for(i=0;i<nfiles;i++) {
+			for(offset=0;offset<sizes[i];offset+=request) fs_read(files[i],buffer,request,offset);
+		}
+		free(buffer);
+	}
+
+	printf("%d files, %d byte reads, %d seconds per run\n",nfiles,request,seconds);
+	for(n=1;;n*=2) {
+		if(n>maxthreads) n = maxthreads;
+		rate = run(n,seconds);
+		if(n==1) single = rate;
+		printf("%d threads: %.1f MB/s, %.2fx one thread\n",n,rate,rate/single);
+		if(n==maxthreads) break;
+	}
+
+	fs_unmount();
+	disk_close();
+	return 0;
+}
@@ -1,6 +1,7 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "dir.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +10,11 @@
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int do_format( char *options );
+static int do_debug( char *options );
+static int do_defrag( char *options );
+static int parse_size( const char *text, int *value );
+static int do_ls( const char *path );
 
 int main( int argc, char *argv[] )
 {
@@ -16,6 +22,7 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
 	int inumber, result, args;
 
 	if(argc!=3) {
@@ -39,34 +46,98 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+			if(do_format(line+strlen("format"))) {
+				printf("disk formatted.\n");
 			} else {
-				printf("use: format\n");
+				printf("format failed!\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
+			int flags = 0;
+			if(args>=2 && !strcmp(arg1,"-l")) flags = FS_MOUNT_LAZY;
+			if(args>=2 && !strcmp(arg1,"-b")) flags = FS_MOUNT_BACKGROUND;
+			if(args>=2 && !strcmp(arg1,"-r")) flags = FS_MOUNT_READONLY;
+			if(args==1 || (args==2 && flags)) {
+				if(fs_mount_with(flags)) {
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
 				}
+			} else if(args==2 && arg1[0]!='-') {
+				if(fs_mount_snapshot(arg1)) {
+					printf("snapshot %s mounted read-only.\n",arg1);
+				} else {
+					printf("mount failed!\n");
+				}
 			} else {
-				printf("use: mount\n");
+				printf("use: mount [-l|-b|-r] or mount <snapshot>\n");
 			}
-		} else if(!strcmp(cmd,"debug")) {
+		} else if(!strcmp(cmd,"snapshot")) {
+			if(args==2) {
+				if(fs_snapshot_create(arg1)) {
+					printf("snapshot %s created.\n",arg1);
+				} else {
+					printf("snapshot failed!\n");
+				}
+			} else {
+				printf("use: snapshot <name>\n");
+			}
+		} else if(!strcmp(cmd,"snapshots")) {
 			if(args==1) {
-				fs_debug();
+				fs_snapshot_list();
+			} else {
+				printf("use: snapshots\n");
+			}
+		} else if(!strcmp(cmd,"rmsnapshot")) {
+			if(args==2) {
+				if(fs_snapshot_delete(arg1)) {
+					printf("snapshot %s deleted.\n",arg1);
+				} else {
+					printf("rmsnapshot failed!\n");
+				}
+			} else {
+				printf("use: rmsnapshot <name>\n");
+			}
+		} else if(!strcmp(cmd,"debug")) {
+			do_debug(line+strlen("debug"));
+		} else if(!strcmp(cmd,"alloc")) {
+			const char *policies[] = {"firstfit","goal","reserve"};
+			int policy = -1, i;
+			for(i=0;args==2 && i<3;i++) {
+				if(!strcmp(arg1,policies[i])) policy = i;
+			}
+			if(policy>=0 && fs_alloc_policy(policy)) {
+				printf("allocating with %s.\n",arg1);
+			} else {
+				printf("use: alloc firstfit|goal|reserve\n");
+			}
+		} else if(!strcmp(cmd,"model")) {
+			if(args==2 && disk_model(arg1)) {
+				printf("device model %s, %.3f s modeled so far.\n",arg1,disk_time());
+			} else {
+				printf("use: model none|hdd|ssd[,overhead=ms][,seek=ms][,rpm=n][,bw=MB/s][,sleep]\n");
+			}
+		} else if(!strcmp(cmd,"defrag")) {
+			result = do_defrag(line+strlen("defrag"));
+			if(result>=0) {
+				printf("%d blocks moved.\n",result);
+			} else {
+				printf("defrag failed!\n");
+			}
+		} else if(!strcmp(cmd,"check")) {
+			struct fs_check_options opts;
+			memset(&opts,0,sizeof(opts));
+			if(args>=2 && !strcmp(arg1,"repair")) opts.flags = FS_CHECK_REPAIR;
+			result = fs_check(&opts);
+			if(result==0) {
+				printf("filesystem is clean.\n");
+			} else if(result>0) {
+				printf("check found %d problems!\n",result);
 			} else {
-				printf("use: debug\n");
+				printf("check failed!\n");
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
@@ -103,6 +174,83 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: delete <inumber>\n");
 			}
+		} else if(!strcmp(cmd,"truncate")) {
+			if(args==3) {
+				inumber = atoi(arg1);
+				if(fs_truncate(inumber,atoi(arg2))) {
+					printf("inode %d truncated to %d bytes.\n",inumber,atoi(arg2));
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <inumber> <size>\n");
+			}
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==4) {
+				inumber = atoi(arg1);
+				if(fs_fallocate(inumber,atoi(arg2),atoi(arg3))) {
+					printf("reserved %d bytes at offset %d of inode %d.\n",atoi(arg3),atoi(arg2),inumber);
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <inumber> <offset> <length>\n");
+			}
+		} else if(!strcmp(cmd,"mkroot")) {
+			if(args==1) {
+				if(dir_mkroot()) {
+					printf("created root directory at inode %d\n",DIR_ROOT);
+				} else {
+					printf("mkroot failed!\n");
+				}
+			} else {
+				printf("use: mkroot\n");
+			}
+		} else if(!strcmp(cmd,"mkdir") || !strcmp(cmd,"touch")) {
+			if(args==2) {
+				int dinumber = dir_parent(arg1,arg2);
+				inumber = 0;
+				if(dinumber) {
+					inumber = !strcmp(cmd,"mkdir") ? dir_mkdir(dinumber,arg2) : dir_create(dinumber,arg2);
+				}
+				if(inumber>0) {
+					printf("created %s as inode %d\n",arg1,inumber);
+				} else {
+					printf("%s failed!\n",cmd);
+				}
+			} else {
+				printf("use: %s <path>\n",cmd);
+			}
+		} else if(!strcmp(cmd,"rm")) {
+			if(args==2) {
+				int dinumber = dir_parent(arg1,arg2);
+				if(dinumber && dir_unlink(dinumber,arg2)) {
+					printf("removed %s\n",arg1);
+				} else {
+					printf("rm failed!\n");
+				}
+			} else {
+				printf("use: rm <path>\n");
+			}
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = dir_resolve(arg1);
+				if(inumber>0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("%s not found\n",arg1);
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+		} else if(!strcmp(cmd,"ls")) {
+			if(args<=2) {
+				if(!do_ls(args==2 ? arg1 : "/")) {
+					printf("ls failed!\n");
+				}
+			} else {
+				printf("use: ls [path]\n");
+			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
@@ -139,11 +287,28 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
+			printf("    format  [compress] [dedup] [discard] [blocksize=<bytes>]\n");
+			printf("            [ratio=<bytes per inode>] [inodes=<count>]\n");
+			printf("    mount   [-l|-b|-r]\n");
+			printf("    mount   <snapshot>\n");
+			printf("    snapshot <name>\n");
+			printf("    snapshots\n");
+			printf("    rmsnapshot <name>\n");
+			printf("    debug   [json] [summary] [inode]\n");
+			printf("    check   [repair]\n");
+			printf("    defrag  [inode] [budget=<blocks>]\n");
+			printf("    alloc   firstfit|goal|reserve\n");
+			printf("    model   none|hdd|ssd[,option=value][,sleep]\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
+			printf("    truncate  <inode> <size>\n");
+			printf("    fallocate <inode> <offset> <length>\n");
+			printf("    mkroot\n");
+			printf("    mkdir   <path>\n");
+			printf("    touch   <path>\n");
+			printf("    rm      <path>\n");
+			printf("    lookup  <path>\n");
+			printf("    ls      [path]\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
@@ -161,6 +326,7 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	fs_unmount();
 	printf("closing emulated disk.\n");
 	disk_close();
 
@@ -170,7 +336,7 @@ int main( int argc, char *argv[] )
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int offset=0, result, actual, append=0;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
@@ -179,11 +345,13 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	// keep the disk plugged across chunks so consecutive writes are merged
+	disk_plug();
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = append ? fs_append(inumber,buffer,result) : fs_write(inumber,buffer,result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
 				break;
@@ -193,8 +361,11 @@ static int do_copyin( const char *filename, int inumber )
 				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
+			// once the file ends where the copy does, the rest only grows it
+			if(!append) append = fs_getsize(inumber)==offset;
 		}
 	}
+	disk_unplug();
 
 	printf("%d bytes copied\n",offset);
 
@@ -227,3 +398,116 @@ static int do_copyout( int inumber, const char *filename )
 	return 1;
 }
 
+
+// reads a positive number with an optional k or m suffix
+static int parse_size( const char *text, int *value )
+{
+	char *end;
+	long n = strtol(text,&end,10);
+
+	if(*end=='k' || *end=='K') {
+		n *= 1024;
+		end++;
+	} else if(*end=='m' || *end=='M') {
+		n *= 1024*1024;
+		end++;
+	}
+	if(end==text || *end || n<=0 || n>0x7fffffff) {
+		printf("bad number: %s\n",text);
+		return 0;
+	}
+	*value = n;
+	return 1;
+}
+
+static int do_format( char *options )
+{
+	struct fs_format_options opts;
+	char *word;
+
+	memset(&opts,0,sizeof(opts));
+
+	for(word=strtok(options," \t"); word; word=strtok(0," \t")) {
+		if(!strcmp(word,"compress")) {
+			opts.flags |= FS_FORMAT_COMPRESS;
+		} else if(!strcmp(word,"dedup")) {
+			opts.flags |= FS_FORMAT_DEDUP;
+		} else if(!strcmp(word,"discard")) {
+			opts.flags |= FS_FORMAT_DISCARD;
+		} else if(!strncmp(word,"blocksize=",strlen("blocksize="))) {
+			if(!parse_size(word+strlen("blocksize="),&opts.blocksize)) return 0;
+		} else if(!strncmp(word,"ratio=",strlen("ratio="))) {
+			if(!parse_size(word+strlen("ratio="),&opts.inoderatio)) return 0;
+		} else if(!strncmp(word,"inodes=",strlen("inodes="))) {
+			if(!parse_size(word+strlen("inodes="),&opts.ninodes)) return 0;
+		} else {
+			printf("unknown format option: %s\n",word);
+			printf("use: format [compress] [dedup] [discard] [blocksize=<bytes>] [ratio=<bytes per inode>] [inodes=<count>]\n");
+			return 0;
+		}
+	}
+
+	return fs_format_with(&opts);
+}
+
+static int do_debug( char *options )
+{
+	struct fs_debug_options opts;
+	char *word, *end;
+
+	memset(&opts,0,sizeof(opts));
+
+	for(word=strtok(options," \t"); word; word=strtok(0," \t")) {
+		if(!strcmp(word,"json")) {
+			opts.flags |= FS_DEBUG_JSON;
+		} else if(!strcmp(word,"summary")) {
+			opts.flags |= FS_DEBUG_SUMMARY;
+		} else if((opts.inumber=strtol(word,&end,10))<=0 || *end) {
+			printf("use: debug [json] [summary] [inode]\n");
+			return 0;
+		}
+	}
+
+	fs_debug_with(&opts);
+	return 1;
+}
+
+static int do_defrag( char *options )
+{
+	struct fs_defrag_options opts;
+	char *word, *end;
+
+	memset(&opts,0,sizeof(opts));
+	opts.flags = FS_DEFRAG_REPORT;
+
+	for(word=strtok(options," \t"); word; word=strtok(0," \t")) {
+		if(!strncmp(word,"budget=",strlen("budget="))) {
+			if(!parse_size(word+strlen("budget="),&opts.budget)) return -1;
+		} else if((opts.inumber=strtol(word,&end,10))<=0 || *end) {
+			printf("use: defrag [inode] [budget=<blocks>]\n");
+			return -1;
+		}
+	}
+
+	return fs_defrag(&opts);
+}
+
+static int do_ls( const char *path )
+{
+	struct dir_cursor cursor;
+	char name[DIR_NAME_MAX+1];
+	int inumber, count=0;
+
+	if(!dir_opendir(dir_resolve(path),&cursor)) {
+		printf("%s is not a directory\n",path);
+		return 0;
+	}
+
+	while(dir_readdir(&cursor,name,&inumber)) {
+		printf("%8d %s%s\n",inumber,name,dir_isdir(inumber) ? "/" : "");
+		count++;
+	}
+
+	printf("%d entries\n",count);
+	return 1;
+}